@@ -7,7 +7,7 @@ using namespace std;
 
 
 int main() {
-	Model model("testModel0");
+	auto model = make_shared<const Model>("testModel0");
 	Data data(model);
 
 	data.resolution = Vector2Int(1920,1080);
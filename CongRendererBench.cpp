@@ -0,0 +1,628 @@
+// CongRendererBench.cpp: benchmarks for the renderer on generated data.
+//
+// usage: CongRendererBench [--quick] [--json file] [--assets dir] [--heatmaps] [gridSize]
+//
+// Meshes and textures are generated into the assets directory (default bench_assets) and loaded like any
+// model, then every stage is timed on them: obj parsing, model and tga loading, image writing, the vertex,
+// geometry, binning, raster and fragment stages, the resolve, whole Renders at several resolutions,
+// anti-aliasing, a scene of many instances and a turntable sequence written to disk.
+// Times are the best of a few runs. Every result is also written to a JSON file (default
+// CongRendererBench.json) to compare builds; --quick runs a smaller set once. --heatmaps writes the depth
+// complexity and tile cost maps of every rendered frame next to the assets.
+
+#include "RenderPipeline.hpp"
+#include "ObjParser.h"
+#include "MathUtil.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#define PI 3.14159265358979f
+
+#if defined(_MSC_VER)
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE __attribute__((noinline))
+#endif
+
+static int runs = 3;
+
+static double Seconds(chrono::steady_clock::time_point t0) {
+	return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+// best of the runs, in ms
+template <class F>
+static double BestMs(F f) {
+	double best = 1e30;
+	for (int run = 0; run < runs; run++) {
+		auto t0 = chrono::steady_clock::now();
+		f();
+		best = min(best, Seconds(t0));
+	}
+	return best * 1000;
+}
+
+#pragma region Results
+
+// one result: a name and its fields, the values already in JSON form
+class BenchRecord {
+public:
+	string name;
+	vector<pair<string, string>> fields;
+
+	BenchRecord& Set(const char* key, double value) {
+		char text[32];
+		snprintf(text, sizeof(text), "%.9g", value);
+		fields.emplace_back(key, text);
+		return *this;
+	}
+	BenchRecord& Set(const char* key, int value) {
+		fields.emplace_back(key, to_string(value));
+		return *this;
+	}
+	// names and labels only, nothing that needs escaping
+	BenchRecord& Set(const char* key, const string& value) {
+		fields.emplace_back(key, "\"" + value + "\"");
+		return *this;
+	}
+};
+
+static deque<BenchRecord> results;
+
+static BenchRecord& Record(const string& name) {
+	results.push_back(BenchRecord());
+	results.back().name = name;
+	return results.back();
+}
+
+static bool WriteJson(const string& file, bool quick) {
+	FILE* out = fopen(file.c_str(), "w");
+	if (!out) {
+		fprintf(stderr, "can't open %s\n", file.c_str());
+		return false;
+	}
+	fprintf(out, "{\n  \"benchmark\": \"CongRendererBench\",\n  \"hardwareThreads\": %d,\n  \"quick\": %s,\n  \"runs\": %d,\n  \"results\": [\n",
+		(int)thread::hardware_concurrency(), quick ? "true" : "false", runs);
+	for (size_t i = 0; i < results.size(); i++) {
+		fprintf(out, "    {\"name\": \"%s\"", results[i].name.c_str());
+		for (auto& field : results[i].fields) fprintf(out, ", \"%s\": %s", field.first.c_str(), field.second.c_str());
+		fprintf(out, "}%s\n", i + 1 < results.size() ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+	fclose(out);
+	return true;
+}
+
+#pragma endregion
+
+#pragma region Generated assets
+
+// a mesh of quads, every vertex with its own position, uv and normal
+class GenMesh {
+public:
+	vector<Vector3> pos;
+	vector<Vector2> uv;
+	vector<Vector3> normals;
+	vector<int> quads; // 4 vertex indices per quad, wound so the side the normal points to is the front
+
+	int triangleCount() const { return (int)quads.size() / 4 * 2; }
+
+	// (nu + 1) x (nv + 1) vertices of surface(u, v, p, n) over [0, 1]^2, nu x nv quads
+	void AddGrid(int nu, int nv, const function<void(float, float, Vector3&, Vector3&)>& surface) {
+		int base = (int)pos.size(), row = nu + 1;
+		for (int j = 0; j <= nv; j++) {
+			for (int i = 0; i <= nu; i++) {
+				float u = (float)i / nu, v = (float)j / nv;
+				Vector3 p, n;
+				surface(u, v, p, n);
+				pos.push_back(p);
+				uv.push_back(Vector2(u, v));
+				normals.push_back(n);
+			}
+		}
+		for (int j = 0; j < nv; j++) {
+			for (int i = 0; i < nu; i++) {
+				int a = base + j * row + i;
+				int quad[4] = { a, a + row, a + row + 1, a + 1 };
+				quads.insert(quads.end(), quad, quad + 4);
+			}
+		}
+	}
+
+	// "f v/vt/vn" quads, every other one written with negative indices
+	string ToObj() const {
+		string text;
+		text.reserve(pos.size() * 100 + quads.size() * 20);
+		char line[256];
+		for (size_t i = 0; i < pos.size(); i++) {
+			snprintf(line, sizeof(line), "v %.6f %.6f %.6f\nvt %.6f %.6f\nvn %.6f %.6f %.6f\n",
+				pos[i].x, pos[i].y, pos[i].z, uv[i].x, uv[i].y, normals[i].x, normals[i].y, normals[i].z);
+			text += line;
+		}
+		int n = (int)pos.size() + 1;
+		for (size_t q = 0; q < quads.size(); q += 4) {
+			int f[4];
+			for (int k = 0; k < 4; k++) f[k] = quads[q + k] + 1 - (q / 4 % 2 ? n : 0);
+			snprintf(line, sizeof(line), "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d\n", f[0], f[0], f[0], f[1], f[1], f[1], f[2], f[2], f[2], f[3], f[3], f[3]);
+			text += line;
+		}
+		return text;
+	}
+};
+
+// unit uv sphere, gridSize x gridSize quads
+static GenMesh SphereMesh(int gridSize) {
+	GenMesh mesh;
+	mesh.AddGrid(gridSize, gridSize, [](float u, float v, Vector3& p, Vector3& n) {
+		p = n = Vector3(sinf(v * PI) * cosf(u * 2 * PI), cosf(v * PI), -sinf(v * PI) * sinf(u * 2 * PI));
+	});
+	return mesh;
+}
+
+// [-1, 1]^2 plane facing -z, gridSize x gridSize quads: many small triangles
+static GenMesh GridMesh(int gridSize) {
+	GenMesh mesh;
+	mesh.AddGrid(gridSize, gridSize, [](float u, float v, Vector3& p, Vector3& n) {
+		p = Vector3(u * 2 - 1, v * 2 - 1, 0);
+		n = Vector3::Back();
+	});
+	return mesh;
+}
+
+// layers of planes covering most of the view, emitted back to front so every layer passes the depth test
+static GenMesh StackMesh(int layers) {
+	GenMesh mesh;
+	for (int k = 0; k < layers; k++) {
+		float z = 1 - 2.f * k / max(1, layers - 1);
+		mesh.AddGrid(4, 4, [z](float u, float v, Vector3& p, Vector3& n) {
+			p = Vector3((u * 2 - 1) * 2.5f, (v * 2 - 1) * 1.5f, z);
+			n = Vector3::Back();
+		});
+	}
+	return mesh;
+}
+
+// checker diffuse, tangent space bumps and a specular power ramp, the names Model looks for
+static void WriteTextures(const string& dir, int size) {
+	TGAImage diffuse(size, size, RGB), normal(size, size, RGB), specular(size, size, RGB);
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x++) {
+			int cell = x * 8 / size + y * 8 / size;
+			diffuse.set(x, y, cell % 2 ? Color32(230, 90, 40) : Color32(60, 140, 220));
+			float u = (float)x / size, v = (float)y / size;
+			auto n = Vector3(0.3f * sinf(u * 16 * PI), 0.3f * sinf(v * 16 * PI), 1).Normalized();
+			normal.set(x, y, Color32((uint8_t)((n.x * 0.5f + 0.5f) * 255), (uint8_t)((n.y * 0.5f + 0.5f) * 255), (uint8_t)((n.z * 0.5f + 0.5f) * 255)));
+			auto power = (uint8_t)(u * 32);
+			specular.set(x, y, Color32(power, power, power));
+		}
+	}
+	diffuse.write_tga_file(dir + "/bench_diffuse.tga");
+	normal.write_tga_file(dir + "/bench_nm_tangent.tga");
+	specular.write_tga_file(dir + "/bench_spec.tga");
+}
+
+// a generated model directory and the model loaded from it
+class BenchMesh {
+public:
+	string name;
+	string dir;
+	int triangles;
+	shared_ptr<const Model> model;
+};
+
+static BenchMesh MakeBenchMesh(const string& assets, const string& name, const GenMesh& mesh, int textureSize) {
+	BenchMesh scene;
+	scene.name = name;
+	scene.dir = assets + "/" + name;
+	scene.triangles = mesh.triangleCount();
+	filesystem::create_directories(scene.dir);
+	auto obj = mesh.ToObj();
+	FILE* out = fopen((scene.dir + "/bench.obj").c_str(), "wb");
+	if (out) {
+		fwrite(obj.data(), 1, obj.size(), out);
+		fclose(out);
+	}
+	WriteTextures(scene.dir, textureSize);
+	filesystem::remove(scene.dir + "/bench.cmesh");
+	scene.model = make_shared<const Model>(scene.dir);
+	return scene;
+}
+
+// the view of CongRenderer's main, without the model rotation: the camera looks at the origin along +z
+static Data MakeView(const BenchMesh& scene, Vector2Int resolution) {
+	Data data(scene.model);
+	data.resolution = resolution;
+	data.modelPos = Vector3(0, 0, 0);
+	data.modelRot = Vector3(0, 0, 0);
+	data.modelScale = 4 * Vector3(1, 1, 1);
+	data.camWorldPos = Vector3(0, 0, -10);
+	data.camDir = Vector3(0, 0, 1);
+	data.camUp = Vector3(0, 1, 0);
+	data.fovy = 60;
+	data.near = -1;
+	data.far = -60;
+	data.lightIntensity = 1;
+	data.lightWorldPos = Vector3(0, 0, -8);
+	data.lightColor = Color32(255, 255, 255, 255);
+	data.ambient = Color32(10, 10, 10, 10);
+	data.diffuseK = 5;
+	data.specularK = 5;
+	data.specularBasePower = 5;
+	data.isTangentSpaceNormalMap = true;
+	return data;
+}
+
+#pragma endregion
+
+#pragma region Benchmarks
+
+// best of a few runs, in MB/s
+static void BenchObjParse(const string& text, int triangles, int threadCount) {
+	double ms = BestMs([&] {
+		ObjMesh mesh;
+		parseObj(text.data(), text.size(), mesh, threadCount);
+	});
+	double mbPerS = text.size() / (ms / 1000) / (1024 * 1024);
+	printf("obj parse  threads %2d  %8.1f ms  %8.1f MB/s  %d triangles\n", threadCount, ms, mbPerS, triangles);
+	Record("obj_parse").Set("triangles", triangles).Set("bytes", (double)text.size()).Set("threads", threadCount).Set("ms", ms).Set("mb_per_s", mbPerS);
+}
+
+// Model(dir): without the .cmesh the obj is parsed and the cache written, with it the mesh is mapped.
+// Both include the three texture loads.
+static void BenchModelLoad(const BenchMesh& scene) {
+	double parsed = BestMs([&] {
+		filesystem::remove(scene.dir + "/bench.cmesh");
+		Model model(scene.dir);
+	});
+	double cached = BestMs([&] { Model model(scene.dir); });
+	printf("model load %-12s parse %8.1f ms  cache %8.1f ms\n", scene.name.c_str(), parsed, cached);
+	Record("model_load").Set("mesh", scene.name).Set("triangles", scene.triangles).Set("cache", string("none")).Set("ms", parsed);
+	Record("model_load").Set("mesh", scene.name).Set("triangles", scene.triangles).Set("cache", string("cmesh")).Set("ms", cached);
+}
+
+// the writers and the tga reader on a rendered frame
+static void BenchImageIO(const TGAImage& img, const string& dir) {
+	double mb = (double)img.get_width() * img.get_height() * img.get_bytespp() / (1024 * 1024);
+	auto report = [&](const char* op, const string& file, double ms) {
+		auto bytes = filesystem::exists(file) ? (double)filesystem::file_size(file) : 0;
+		printf("image %-14s %8.2f ms  %8.1f MB/s  %10.0f bytes\n", op, ms, mb / (ms / 1000), bytes);
+		Record("image_io").Set("op", string(op)).Set("width", img.get_width()).Set("height", img.get_height())
+			.Set("ms", ms).Set("mb_per_s", mb / (ms / 1000)).Set("file_bytes", bytes);
+	};
+	auto file = dir + "/frame_rle.tga";
+	report("tga_write_rle", file, BestMs([&] { img.write_tga_file(file); }));
+	report("tga_read_rle", file, BestMs([&] { TGAImage read; read.read_tga_file(file); }));
+	file = dir + "/frame.tga";
+	report("tga_write_raw", file, BestMs([&] { img.write_tga_file(file, true, false); }));
+	report("tga_read_raw", file, BestMs([&] { TGAImage read; read.read_tga_file(file); }));
+	file = dir + "/frame.png";
+	report("png_write", file, BestMs([&] { img.write_png_file(file); }));
+	file = dir + "/frame.ppm";
+	report("ppm_write", file, BestMs([&] { img.write_ppm_file(file); }));
+}
+
+// RenderFrame's stages one after another on the calling thread. The visibility buffer splits rasterization
+// (coverage, depth, triangle ids) from fragment shading, so the two are timed apart.
+static void BenchStages(const BenchMesh& scene, Vector2Int resolution) {
+	typedef BlinnPhongShader<NormalSource::TangentSpaceMap> Shader;
+	auto data = MakeView(scene, resolution);
+	data.visibilityBuffer = true;
+	data.length = data.width() * data.height();
+	InitData(data);
+
+	int vertCount = scene.model->uniqueVertCount(), facetCount = scene.model->facetCount();
+	VertexBuffer vb;
+	vb.resize(vertCount, Shader::varyings);
+	VertexGather gather;
+	gather.resize(vertCount);
+	double vertexMs = BestMs([&] { VertexStage<Shader>(data, 0, vertCount, vb, gather); });
+
+	vector<Triangle> triangles;
+	double geometryMs = BestMs([&] {
+		triangles.clear();
+		RenderCounters counters;
+		GeometryStage<Shader>(data, vb, 0, facetCount, triangles, counters);
+	});
+
+	vector<Tile> tiles;
+	double binMs = BestMs([&] { BinTriangles(triangles, data, tiles); });
+
+	TileBuffer buffer(data.tileSize, data.tileSize, data.targetFormat);
+	RenderTarget frame(data.width(), data.height(), data.targetFormat);
+	double rasterMs = 1e30, fragmentMs = 1e30;
+	for (int run = 0; run < runs; run++) {
+		double raster = 0, fragment = 0;
+		for (auto& tile : tiles) {
+			if (tile.triangles.empty()) continue;
+			BeginTile(tile, data, buffer);
+			auto t0 = chrono::steady_clock::now();
+			for (auto i : tile.triangles) Rasterize<Shader>(triangles[i], i, data, buffer);
+			raster += Seconds(t0);
+			t0 = chrono::steady_clock::now();
+			ShadeVisibilityBuffer<Shader>(triangles, data, buffer);
+			fragment += Seconds(t0);
+			frame.copyRect(buffer.target, tile.x0 - buffer.ox, tile.y0 - buffer.oy, tile.x0, tile.y0, buffer.width(), buffer.height());
+		}
+		rasterMs = min(rasterMs, raster * 1000);
+		fragmentMs = min(fragmentMs, fragment * 1000);
+	}
+	double resolveMs = BestMs([&] { frame.resolve(data.tonemap, data.exposure); });
+
+	printf("stages %-12s %4dx%-4d  vertex %7.2f  geometry %7.2f  bin %6.2f  raster %7.2f  fragment %7.2f  resolve %6.2f ms\n",
+		scene.name.c_str(), resolution.x, resolution.y, vertexMs, geometryMs, binMs, rasterMs, fragmentMs, resolveMs);
+	auto record = [&](const char* stage, double ms, int items, const char* unit) {
+		Record("stage").Set("mesh", scene.name).Set("triangles", scene.triangles).Set("width", resolution.x).Set("height", resolution.y)
+			.Set("stage", string(stage)).Set("ms", ms).Set("items", items).Set("unit", string(unit)).Set("ns_per_item", items ? ms * 1e6 / items : 0);
+	};
+	record("vertex", vertexMs, vertCount, "vertex");
+	record("geometry", geometryMs, facetCount, "facet");
+	record("bin", binMs, (int)triangles.size(), "triangle");
+	record("raster", rasterMs, (int)triangles.size(), "triangle");
+	record("fragment", fragmentMs, data.length, "pixel");
+	record("resolve", resolveMs, data.length, "pixel");
+}
+
+// whole frames through Render, on every hardware thread. With a heatmap dir the frame's diagnostic maps
+// are written there as <mesh>_<width>x<height>_*.tga
+static TGAImage BenchRender(const BenchMesh& scene, Vector2Int resolution, const string& heatmapDir) {
+	auto data = MakeView(scene, resolution);
+	TGAImage img;
+	double ms = BestMs([&] { img = Render(data); });
+	// the counts are the same every run, one more frame collects them
+	RenderStats stats;
+	stats.heatmaps = !heatmapDir.empty();
+	Render(data, &stats);
+	if (stats.heatmaps) stats.WriteHeatmaps(heatmapDir + "/" + scene.name + "_" + to_string(resolution.x) + "x" + to_string(resolution.y));
+	double mpixels = (double)resolution.x * resolution.y / 1e6;
+	printf("render %-12s %4dx%-4d  %8.2f ms  %7.1f Mpixel/s  %6.1f Mtriangle/s  overdraw %.2f\n",
+		scene.name.c_str(), resolution.x, resolution.y, ms, mpixels / (ms / 1000), scene.triangles / 1e6 / (ms / 1000), stats.overdrawRatio());
+	Record("render").Set("mesh", scene.name).Set("triangles", scene.triangles).Set("width", resolution.x).Set("height", resolution.y)
+		.Set("threads", (int)thread::hardware_concurrency()).Set("ms", ms).Set("mpixels_per_s", mpixels / (ms / 1000))
+		.Set("fragments_tested", (double)stats.fragmentsTested).Set("fragments_shaded", (double)stats.fragmentsShaded)
+		.Set("overdraw_ratio", stats.overdrawRatio()).Set("scratch_bytes", (double)stats.scratchBytes);
+	return img;
+}
+
+// anti-aliasing: one sample per pixel, 4x msaa, and the supersampling msaa replaces, rendering at twice the
+// width and height (the downscale is not timed)
+static void BenchMsaa(const BenchMesh& scene, Vector2Int resolution) {
+	auto data = MakeView(scene, resolution);
+	double noneMs = BestMs([&] { Render(data); });
+	data.msaa = 4;
+	double msaaMs = BestMs([&] { Render(data); });
+	data.msaa = 1;
+	data.resolution = Vector2Int(resolution.x * 2, resolution.y * 2);
+	double ssaaMs = BestMs([&] { Render(data); });
+
+	printf("antialias %-12s %4dx%-4d  none %8.2f ms  msaa 4x %8.2f ms  supersampled 2x2 %8.2f ms\n",
+		scene.name.c_str(), resolution.x, resolution.y, noneMs, msaaMs, ssaaMs);
+	Record("antialias").Set("mesh", scene.name).Set("triangles", scene.triangles).Set("width", resolution.x).Set("height", resolution.y)
+		.Set("none_ms", noneMs).Set("msaa4_ms", msaaMs).Set("ssaa4_ms", ssaaMs);
+}
+
+// a turntable written to disk as tga, once with a Render and a write per frame and once through RenderSequence,
+// which keeps its buffers and writes frame n - 1 on a background thread while frame n renders
+static void BenchSequence(const BenchMesh& scene, Vector2Int resolution, int frameCount, const string& dir) {
+	auto turn = [frameCount](int frame, Data& data) { data.modelRot = Vector3(0, 360.f * frame / frameCount, 0); };
+	auto file = [&](int frame) { return dir + "/turntable_" + to_string(frame) + ".tga"; };
+
+	auto data = MakeView(scene, resolution);
+	auto t0 = chrono::steady_clock::now();
+	for (int i = 0; i < frameCount; i++) {
+		turn(i, data);
+		Render(data).write_tga_file(file(i));
+	}
+	double serialMs = Seconds(t0) * 1000 / frameCount;
+
+	data = MakeView(scene, resolution);
+	t0 = chrono::steady_clock::now();
+	RenderSequence(data, frameCount, turn, [&](int frame, const TGAImage& img) { img.write_tga_file(file(frame)); });
+	double sequenceMs = Seconds(t0) * 1000 / frameCount;
+
+	printf("sequence %-12s %4dx%-4d %3d frames  render + write %7.2f ms/frame  RenderSequence %7.2f ms/frame\n",
+		scene.name.c_str(), resolution.x, resolution.y, frameCount, serialMs, sequenceMs);
+	Record("sequence").Set("mesh", scene.name).Set("triangles", scene.triangles).Set("width", resolution.x).Set("height", resolution.y)
+		.Set("frames", frameCount).Set("serial_ms_per_frame", serialMs).Set("sequence_ms_per_frame", sequenceMs);
+}
+
+// side x side instances of one mesh on a ground plane in front of the camera, reaching far past the far plane
+// and out to the sides, so most are outside the view: the hierarchy build, and frames with the instances culled
+// by their bounds and with every instance sent through the vertex and geometry stages
+static void BenchScene(const BenchMesh& mesh, Vector2Int resolution, int side) {
+	Scene scene;
+	for (int z = 0; z < side; z++) {
+		for (int x = 0; x < side; x++) scene.Add(mesh.model, Vector3(3.f * (x - side / 2), -2, 3.f * z), Vector3(0, 37.f * (x + z), 0));
+	}
+	double buildMs = BestMs([&] { scene.Build(); });
+
+	auto view = MakeView(mesh, resolution);
+	RenderContext context(view.threadCount);
+	RenderStats stats;
+	// a first frame of each sizes the context's buffers
+	RenderFrame(view, context, nullptr, &scene);
+	double culledMs = BestMs([&] { RenderFrame(view, context, &stats, &scene); });
+	view.cullInstances = false;
+	RenderFrame(view, context, nullptr, &scene);
+	double allMs = BestMs([&] { RenderFrame(view, context, nullptr, &scene); });
+
+	int drawn = stats.instancesIn - stats.instancesCulled;
+	printf("scene %-12s %6d instances  build %7.2f ms  setup %6.2f ms  %5d drawn %8.2f ms  all drawn %8.2f ms\n",
+		mesh.name.c_str(), stats.instancesIn, buildMs, stats.setupMs, drawn, culledMs, allMs);
+	Record("scene").Set("mesh", mesh.name).Set("triangles", mesh.triangles).Set("width", resolution.x).Set("height", resolution.y)
+		.Set("instances", stats.instancesIn).Set("instances_drawn", drawn).Set("build_ms", buildMs).Set("setup_ms", stats.setupMs)
+		.Set("culled_ms", culledMs).Set("unculled_ms", allMs);
+}
+
+// the math as it was before it moved into MathUtil.h, as the baseline: the matrix product out of line,
+// a Vector4 copy per row, indexed access through a switch and inversion by 16 3x3 cofactors
+namespace legacy {
+	inline float& At(Vector4& v, int i) {
+		switch (i) {
+		case 0: return v.x;
+		case 1: return v.y;
+		case 2: return v.z;
+		}
+		return v.w;
+	}
+
+	inline float Dot(Vector4 a, Vector4 b) {
+		float sum = 0.f;
+		for (int i = 0; i < 4; i++) sum += At(a, i) * At(b, i);
+		return sum;
+	}
+
+	NOINLINE Vector4 Mul(Matrix4x4& m, Vector4& v) {
+		Vector4 ret;
+		for (int i = 0; i < 4; i++) At(ret, i) = Dot(m.Row(i), v);
+		return ret;
+	}
+
+	inline Vector3 TranslatePoint(Matrix4x4& m, Vector3& p) {
+		Vector4 h(p.x, p.y, p.z, 1);
+		auto r = Mul(m, h);
+		if (r.w == 0) return (Vector3)r;
+		return Vector3(r.x / r.w, r.y / r.w, r.z / r.w);
+	}
+
+	NOINLINE Matrix4x4 Invert(Matrix4x4& a) {
+		Matrix4x4 adj;
+		for (int i = 0; i < 4; i++) {
+			for (int j = 0; j < 4; j++) adj.data[j][i] = Matrix4x4::Cofactor(a, i, j);
+		}
+		float det = 0;
+		for (int i = 0; i < 4; i++) det += a.data[0][i] * Matrix4x4::Cofactor(a, 0, i);
+		return adj / det;
+	}
+}
+
+// legacy per-point transforms against the inlined and batch paths, in ns per point
+static void BenchMath(int count) {
+	vector<Vector3> points(count), out3(count);
+	vector<Vector4> out4(count);
+	for (int i = 0; i < count; i++) {
+		points[i] = Vector3(sinf(i * 0.37f), cosf(i * 0.11f), sinf(i * 0.05f) * 3);
+	}
+	float m[4][4] = { { 0.8f, -0.6f, 0, 1 }, { 0.6f, 0.8f, 0, 2 }, { 0, 0, 1, -10 }, { 0, 0, 0, 1 } };
+	float p[4][4] = { { 1.3f, 0, 0, 0 }, { 0, 1.7f, 0, 0 }, { 0, 0, -1.02f, -2.02f }, { 0, 0, -1, 0 } };
+	Matrix4x4 affine(m), proj(p);
+	auto mvp = proj * affine;
+	Affine3x4 affine3x4(affine);
+
+	auto report = [&](const char* name, double legacy, double current) {
+		printf("math %-20s legacy %6.2f ns  now %6.2f ns  x%.1f\n", name, legacy * 1e9 / count, current * 1e9 / count, legacy / current);
+		Record("math").Set("op", string(name)).Set("legacy_ns", legacy * 1e9 / count).Set("ns", current * 1e9 / count);
+	};
+	double checksum = 0;
+	auto best = [&](auto f) {
+		double t = 1e30;
+		for (int run = 0; run < 3; run++) {
+			auto t0 = chrono::steady_clock::now();
+			f();
+			t = min(t, Seconds(t0));
+		}
+		return t;
+	};
+
+	double legacy = best([&] { for (int i = 0; i < count; i++) out3[i] = legacy::TranslatePoint(affine, points[i]); });
+	checksum += out3[count - 1].x;
+	double single = best([&] { for (int i = 0; i < count; i++) out3[i] = affine3x4.TransformPoint(points[i]); });
+	checksum += out3[count - 1].x;
+	double batch = best([&] { TransformPoints(affine3x4, points.data(), out3.data(), count); });
+	checksum += out3[count - 1].x;
+	report("affine point", legacy, single);
+	report("affine point batch", legacy, batch);
+
+	legacy = best([&] { for (int i = 0; i < count; i++) out3[i] = legacy::TranslatePoint(mvp, points[i]); });
+	checksum += out3[count - 1].x;
+	batch = best([&] {
+		TransformPoints(mvp, points.data(), out4.data(), count);
+		for (int i = 0; i < count; i++) out3[i] = Vector3(out4[i].x / out4[i].w, out4[i].y / out4[i].w, out4[i].z / out4[i].w);
+	});
+	checksum += out3[count - 1].x;
+	report("projective batch", legacy, batch);
+
+	// inversions of slightly different matrices, so nothing is hoisted
+	int inversions = count / 16;
+	auto inverse = [&](bool old) {
+		Matrix4x4 a = mvp, sum;
+		for (int i = 0; i < inversions; i++) {
+			a.data[0][3] = (float)i;
+			auto inv = old ? legacy::Invert(a) : a.Inverse();
+			sum.data[0][0] += inv.data[0][0];
+		}
+		checksum += sum.data[0][0];
+	};
+	legacy = best([&] { inverse(true); }) * count / inversions;
+	double closed = best([&] { inverse(false); }) * count / inversions;
+	report("4x4 inverse", legacy, closed);
+	if (checksum == 1234.5) printf("\n"); // keeps the results alive
+}
+
+#pragma endregion
+
+int main(int argc, char** argv) {
+	int gridSize = 0;
+	bool quick = false, heatmaps = false;
+	string jsonFile = "CongRendererBench.json", assets = "bench_assets";
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--quick") quick = true;
+		else if (arg == "--json" && i + 1 < argc) jsonFile = argv[++i];
+		else if (arg == "--assets" && i + 1 < argc) assets = argv[++i];
+		else if (arg == "--heatmaps") heatmaps = true;
+		else gridSize = atoi(argv[i]);
+	}
+	if (quick) runs = 1;
+	if (gridSize <= 0) gridSize = quick ? 128 : 512;
+	filesystem::create_directories(assets);
+
+	// obj parsing on the largest sphere
+	auto t0 = chrono::steady_clock::now();
+	auto sphere = SphereMesh(gridSize);
+	auto obj = sphere.ToObj();
+	printf("generated %.1f MB obj in %.1f ms\n", obj.size() / (1024.0 * 1024.0), Seconds(t0) * 1000);
+	int hardwareThreads = (int)thread::hardware_concurrency();
+	BenchObjParse(obj, sphere.triangleCount(), 1);
+	if (hardwareThreads > 1) BenchObjParse(obj, sphere.triangleCount(), hardwareThreads);
+
+	// a range of triangle counts, many tiny triangles and heavy overdraw
+	vector<BenchMesh> scenes;
+	int textureSize = quick ? 256 : 1024;
+	scenes.push_back(MakeBenchMesh(assets, "sphere_32", SphereMesh(32), textureSize));
+	scenes.push_back(MakeBenchMesh(assets, "sphere_128", SphereMesh(128), textureSize));
+	if (gridSize > 128) scenes.push_back(MakeBenchMesh(assets, "sphere_" + to_string(gridSize), sphere, textureSize));
+	scenes.push_back(MakeBenchMesh(assets, quick ? "grid_128" : "grid_512", GridMesh(quick ? 128 : 512), textureSize));
+	scenes.push_back(MakeBenchMesh(assets, "stack_8", StackMesh(8), textureSize));
+
+	for (auto& scene : scenes) BenchModelLoad(scene);
+
+	vector<Vector2Int> resolutions = { Vector2Int(640, 360), Vector2Int(1920, 1080) };
+	if (!quick) resolutions.push_back(Vector2Int(3840, 2160));
+	for (auto& scene : scenes) BenchStages(scene, Vector2Int(1920, 1080));
+	TGAImage frame;
+	for (auto& scene : scenes) {
+		for (auto resolution : resolutions) {
+			auto img = BenchRender(scene, resolution, heatmaps ? assets : "");
+			if (scene.name == "sphere_128" && resolution.x == 1920) frame = img;
+		}
+	}
+
+	BenchMsaa(scenes[1], Vector2Int(1920, 1080));
+	BenchSequence(scenes[1], Vector2Int(1920, 1080), quick ? 8 : 60, assets);
+	BenchScene(scenes[0], Vector2Int(1920, 1080), quick ? 32 : 100);
+	BenchImageIO(frame, assets);
+	BenchMath(quick ? 1 << 16 : 1 << 20);
+
+	if (!WriteJson(jsonFile, quick)) return 1;
+	printf("results in %s\n", jsonFile.c_str());
+	return 0;
+}
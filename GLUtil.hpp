@@ -2,6 +2,7 @@
 #include <math.h>;
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
 
 #define DEG2RAD 0.0174533f
 
@@ -15,19 +16,19 @@ float Max(float a0, float a1, float a2) {
 	return max(a0, max(a1, a2));
 }
 
-float Lerp(Vector3& barCoo, float val0, float val1, float val2) {
+float Lerp(const Vector3& barCoo, float val0, float val1, float val2) {
 	return (barCoo.x * val0) + (barCoo.y * val1) + (barCoo.z * val2);
 }
 
-Vector3 Lerp(Vector3& barCoo, Vector3& val0, Vector3& val1, Vector3& val2) {
+Vector3 Lerp(const Vector3& barCoo, const Vector3& val0, const Vector3& val1, const Vector3& val2) {
 	return (barCoo.x * val0) + (barCoo.y * val1) + (barCoo.z * val2);
 }
 
-Vector2 Lerp(Vector3& barCoo, Vector2& val0, Vector2& val1, Vector2& val2) {
+Vector2 Lerp(const Vector3& barCoo, const Vector2& val0, const Vector2& val1, const Vector2& val2) {
 	return (barCoo.x * val0) + (barCoo.y * val1) + (barCoo.z * val2);
 }
 
-Color32 Lerp(Vector3& barCoo, Color32& val0, Color32& val1, Color32& val2) {
+Color32 Lerp(const Vector3& barCoo, Color32& val0, Color32& val1, Color32& val2) {
 	auto r = (uint8_t)(barCoo.x * val0.r() + barCoo.y * val1.r() + barCoo.z * val2.r());
 	auto g = (uint8_t)(barCoo.x * val0.g() + barCoo.y * val1.g() + barCoo.z * val2.g());
 	auto b = (uint8_t)(barCoo.x * val0.b() + barCoo.y * val1.b() + barCoo.z * val2.b());
@@ -36,30 +37,30 @@ Color32 Lerp(Vector3& barCoo, Color32& val0, Color32& val1, Color32& val2) {
 }
 
 
-Vector4 HomogeneousCoordinate(Vector3& v, bool isPoint) {
+Vector4 HomogeneousCoordinate(const Vector3& v, bool isPoint) {
 	return Vector4(v.x, v.y, v.z, isPoint ? 1 : 0);
 }
 
-Vector3 HomogeneousDivide(Vector4& v) {
+Vector3 HomogeneousDivide(const Vector4& v) {
 	if (v.w == 0) return (Vector3)v;
 	return Vector3(v.x / v.w, v.y / v.w, v.z / v.w);
 }
 
 
-Vector3 TranslatePoint(Matrix4x4& mat, Vector3& point) {
+Vector3 TranslatePoint(const Matrix4x4& mat, const Vector3& point) {
 	return HomogeneousDivide(mat * HomogeneousCoordinate(point, true));
 }
 
-Vector3 TranslateDir(Matrix4x4& mat, Vector3& dir) {
+Vector3 TranslateDir(const Matrix4x4& mat, const Vector3& dir) {
 	return HomogeneousDivide(mat * HomogeneousCoordinate(dir, false)).Normalized();
 }
 
-Vector3 TranslateVector(Matrix4x4& mat, Vector3& vec) {
+Vector3 TranslateVector(const Matrix4x4& mat, const Vector3& vec) {
 	return HomogeneousDivide(mat * HomogeneousCoordinate(vec, false));
 }
 
 // ϵ任
-Matrix4x4 Translate(Vector3& o, Vector3& u, Vector3& v, Vector3& w) {
+Matrix4x4 Translate(const Vector3& o, const Vector3& u, const Vector3& v, const Vector3& w) {
 	auto um = u.Magnitude();
 	auto vm = v.Magnitude();
 	auto wm = w.Magnitude();
@@ -91,7 +92,7 @@ Matrix4x4 Translate(Vector3& o, Vector3& u, Vector3& v, Vector3& w) {
 	return s * r * t;
 }
 
-Matrix4x4 AffineToCooSystem(Vector3& o, Vector3& u, Vector3& v, Vector3& w) {
+Matrix4x4 AffineToCooSystem(const Vector3& o, const Vector3& u, const Vector3& v, const Vector3& w) {
 	auto um = u.Magnitude();
 	auto vm = v.Magnitude();
 	auto wm = w.Magnitude();
@@ -123,7 +124,7 @@ Matrix4x4 AffineToCooSystem(Vector3& o, Vector3& u, Vector3& v, Vector3& w) {
 	return s * r * t;
 }
 
-Matrix4x4 TRS(Vector3& pos, Vector3& rot, Vector3& scale) {
+Matrix4x4 TRS(const Vector3& pos, const Vector3& rot, const Vector3& scale) {
 	float tdata[4][4] = {
 		{1, 0, 0, pos.x},
 		{0, 1, 0, pos.y},
@@ -169,11 +170,11 @@ Matrix4x4 TRS(Vector3& pos, Vector3& rot, Vector3& scale) {
 
 #pragma region MVP Viewport
 
-Matrix4x4 ModelMat(Vector3& pos, Vector3& rot, Vector3& scale) {
+Matrix4x4 ModelMat(const Vector3& pos, const Vector3& rot, const Vector3& scale) {
 	return TRS(pos, rot, scale);
 }
 
-Matrix4x4 ViewMat(Vector3& camPos, Vector3& camDir, Vector3& camUp) {
+Matrix4x4 ViewMat(const Vector3& camPos, const Vector3& camDir, const Vector3& camUp) {
 	return Translate(camPos, Vector3::Cross(camUp, -camDir), camUp, -camDir);
 }
 
@@ -219,7 +220,7 @@ Matrix4x4 ViewportMat(float width, float height) {
 #pragma endregion
 
 // Χ
-void getBoundingBox(Vector2& p0, Vector2& p1, Vector2& p2, int& xmin, int& xmax,
+void getBoundingBox(const Vector2& p0, const Vector2& p1, const Vector2& p2, int& xmin, int& xmax,
  int& ymin, int& ymax) {
 	xmin = roundf(Min(p0.x, p1.x, p2.x));
 	xmax = roundf(Max(p0.x, p1.x, p2.x));
@@ -227,12 +228,12 @@ void getBoundingBox(Vector2& p0, Vector2& p1, Vector2& p2, int& xmin, int& xmax,
 	ymax = roundf(Max(p0.y, p1.y, p2.y));
 }
 
-float crossProductZ(Vector2& a, Vector2& b) {
+float crossProductZ(const Vector2& a, const Vector2& b) {
 	return a.x * b.y - b.x * a.y;
 }
 
 // 
-Vector3 barycentricCoordinate(Vector2& p, Vector2& a, Vector2& b, Vector2& c) {
+Vector3 barycentricCoordinate(const Vector2& p, const Vector2& a, const Vector2& b, const Vector2& c) {
 	auto x = (-(p.x - b.x) * (c.y - b.y) + (p.y - b.y) * (c.x - b.x)) /
 		(-(a.x - b.x) * (c.y - b.y) + (a.y - b.y) * (c.x - b.x));
 	auto y = (-(p.x - c.x) * (a.y - c.y) + (p.y - c.y) * (a.x - c.x)) /
@@ -241,7 +242,65 @@ Vector3 barycentricCoordinate(Vector2& p, Vector2& a, Vector2& b, Vector2& c) {
 	return Vector3(x, y, z);
 }
 
-bool isPointInsideTriangle(Vector2& p, Vector2& p0, Vector2& p1, Vector2& p2) {
+bool isPointInsideTriangle(const Vector2& p, const Vector2& p0, const Vector2& p1, const Vector2& p2) {
 	auto bar = barycentricCoordinate(p, p0, p1, p2);
 	return bar.x >= 0 && bar.y >= 0 && bar.z >= 0;
 }
+
+#pragma region Fixed-point edge function
+
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_STEPS (1 << SUBPIXEL_BITS)
+// screen positions are limited to +-MAX_RASTER_COORD pixels, which keeps |E| well below 2^53
+#define MAX_RASTER_COORD (1 << 19)
+// triangles are clipped to this many pixels around the viewport center, so clipped ones stay in the fixed-point range
+#define GUARD_BAND (1 << 18)
+
+int64_t toFixed(float v) {
+	return (int64_t)llroundf(v * SUBPIXEL_STEPS);
+}
+
+// first pixel >= fixed-point v
+int fixedCeil(int64_t v) {
+	return (int)((v + SUBPIXEL_STEPS - 1) >> SUBPIXEL_BITS);
+}
+
+// last pixel <= fixed-point v
+int fixedFloor(int64_t v) {
+	return (int)(v >> SUBPIXEL_BITS);
+}
+
+// E(p) = a * (p.x - x0) + b * (p.y - y0) for the edge (x0, y0) -> (x1, y1), all in fixed point.
+// E is twice the signed area of (p0, p1, p), it changes by a per pixel step in x and by b per step in y.
+struct EdgeFunction {
+	int64_t a, b;
+	int64_t x0, y0;
+	int64_t bias; // 0 if pixels exactly on the edge are drawn (top-left rule), -1 if not
+
+	EdgeFunction() {}
+	EdgeFunction(int64_t x0, int64_t y0, int64_t x1, int64_t y1) :a(y0 - y1), b(x1 - x0), x0(x0), y0(y0), bias(0) {}
+
+	int64_t AtFixed(int64_t x, int64_t y) const {
+		return a * (x - x0) + b * (y - y0);
+	}
+
+	// value at the sample point of pixel (x, y)
+	int64_t At(int x, int y) const {
+		return AtFixed((int64_t)x * SUBPIXEL_STEPS, (int64_t)y * SUBPIXEL_STEPS);
+	}
+
+	int64_t StepX() const { return a * SUBPIXEL_STEPS; }
+	int64_t StepY() const { return b * SUBPIXEL_STEPS; }
+
+	void Flip() {
+		a = -a;
+		b = -b;
+	}
+
+	// with the inner side positive and y pointing up, left edges run downwards and top edges run to -x
+	bool IsTopLeft() const {
+		return a > 0 || (a == 0 && b < 0);
+	}
+};
+
+#pragma endregion
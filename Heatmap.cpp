@@ -0,0 +1,35 @@
+#include "Heatmap.h"
+#include <algorithm>
+#include <cstring>
+
+Color32 HeatColor(float t)
+{
+	static const uint8_t stops[][3] = {
+		{ 0, 0, 0 }, { 0, 0, 255 }, { 0, 255, 255 }, { 0, 255, 0 }, { 255, 255, 0 }, { 255, 0, 0 },
+	};
+	const int last = sizeof(stops) / sizeof(stops[0]) - 1;
+	// max first, so nan becomes 0
+	t = min(1.f, max(0.f, t)) * last;
+	int i = min((int)t, last - 1);
+	float f = t - i;
+	uint8_t c[3];
+	for (int k = 0; k < 3; k++) c[k] = (uint8_t)(stops[i][k] + (stops[i + 1][k] - stops[i][k]) * f + 0.5f);
+	return Color32(c[0], c[1], c[2]);
+}
+
+TGAImage HeatmapImage(const vector<float>& values, int w, int h, int cellSize, float maxValue)
+{
+	TGAImage img(w, h, Format::RGBA);
+	int cellsX = (w + cellSize - 1) / cellSize;
+	float scale = maxValue > 0 ? 1 / maxValue : 0;
+	vector<Color32> colors(values.size());
+	for (size_t i = 0; i < values.size(); i++) colors[i] = HeatColor(values[i] * scale);
+
+	size_t stride = (size_t)w * Format::RGBA;
+	for (int y = 0; y < h; y++) {
+		auto row = img.buffer() + y * stride;
+		auto cells = &colors[y / cellSize * cellsX];
+		for (int x = 0; x < w; x++) memcpy(row + x * Format::RGBA, cells[x / cellSize].bgra, Format::RGBA);
+	}
+	return img;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include "tgaimage.h"
+#include <vector>
+
+using namespace std;
+
+// false color for t in [0, 1]: black, blue, cyan, green, yellow, red; t is clamped
+Color32 HeatColor(float t);
+
+// w x h image of a grid of cells, each cellSize pixels square and colored by value / maxValue.
+// values holds ceil(w / cellSize) x ceil(h / cellSize) cells row by row, y = 0 is the first row of the image
+// like in a rendered frame. A maxValue of 0 gives a black image.
+TGAImage HeatmapImage(const vector<float>& values, int w, int h, int cellSize, float maxValue);
@@ -1,312 +1,222 @@
 #include "MathUtil.h"
 
-#pragma region Vector2Int
-Vector2Int::Vector2Int(int x, int y) :x(x), y(y)
-{
-}
-
-Vector2Int::operator Vector2()
-{
-	return Vector2(x, y);
-}
-
-#pragma endregion
-
-#pragma region Vector2
-
-Vector2::Vector2(float x, float y) :x(x), y(y)
-{
-}
-
-float Vector2::Magnitude()
-{
-	return sqrt(x * x + y * y);
-}
-
-Vector2 Vector2::Normalized()
-{
-	auto m = Magnitude();
-	return Vector2(x / m, y / m);
-}
-
-Vector2 operator+(Vector2 a, Vector2 b)
-{
-	return Vector2(a.x + b.x, a.y + b.y);
-}
-
-Vector2 operator*(float a, Vector2 b)
-{
-	return Vector2(a * b.x, a * b.y);
-}
-
-Vector2 operator-(Vector2 a)
-{
-	return Vector2(-a.x, -a.y);
-}
-
-Vector2 operator-(Vector2 a, Vector2 b)
-{
-	return Vector2(a.x - b.x, a.y - b.y);
-}
-
-float Vector2::Dot(Vector2 a, Vector2 b)
-{
-	return a.x * b.x + a.y * b.y;
-}
-#pragma endregion
-
-#pragma region Vector3
-
-Vector3::Vector3(float x, float y, float z) :x(x), y(y), z(z)
-{
-}
-
-float Vector3::Magnitude()
-{
-	return sqrt(x * x + y * y + z * z);
-}
-
-Vector3 Vector3::Normalized()
-{
-	auto m = Magnitude();
-	return Vector3(x / m, y / m, z / m);
-}
-
-Vector3::operator Vector2()
-{
-	return Vector2(x, y);
-}
-
-Vector3 operator/(Vector3 a, float b)
-{
-	return Vector3(a.x / b, a.y / b, a.z / b);
-}
-
-Vector3 operator-(Vector3 a)
-{
-	return Vector3(-a.x, -a.y, -a.z);
-}
-
-Vector3 operator-(Vector3 a, Vector3 b)
-{
-	return Vector3(a.x - b.x, a.y - b.y, a.z - b.z);
-}
-
-Vector3 operator+(Vector3 a, Vector3 b)
-{
-	return Vector3(a.x + b.x, a.y + b.y, a.z + b.z);
-}
-
-Vector3 operator*(float a, Vector3 b)
-{
-	return Vector3(a * b.x, a * b.y, a * b.z);
-}
-
-Vector3 operator*(Vector3 b, float a)
-{
-	return Vector3(a * b.x, a * b.y, a * b.z);
-}
-
-Vector3 Vector3::Zero()
-{
-	return Vector3(0, 0, 0);
-}
-
-Vector3 Vector3::Back()
-{
-	return Vector3(0, 0, -1);
-}
-
-Vector3 Vector3::Forward()
-{
-	return Vector3(0, 0, 1);
-}
-
-float Vector3::Dot(Vector3 a, Vector3 b)
-{
-	return a.x * b.x + a.y * b.y + a.z * b.z;
-}
-
-Vector3 Vector3::Cross(Vector3 lhs, Vector3 rhs)
-{
-	return Vector3(lhs.y * rhs.z - rhs.y * lhs.z,
-		-(lhs.x * rhs.z - rhs.x * lhs.z),
-		lhs.x * rhs.y - rhs.x * lhs.y);
-}
-#pragma endregion
-
-#pragma region Vector4
-
-Vector4::Vector4()
-{
-}
+#pragma region Matrix
 
-Vector4::Vector4(float x, float y, float z, float w) :x(x), y(y), z(z), w(w)
-{
+float Matrix4x4::Det3x3(const float m[][3]) {
+	return
+		m[0][0] * m[1][1] * m[2][2] + m[0][1] * m[1][2] * m[2][0] + m[0][2] * m[1][0] * m[2][1]
+		- m[0][2] * m[1][1] * m[2][0] - m[0][1] * m[1][0] * m[2][2] - m[0][0] * m[1][2] * m[2][1];
 }
 
-float& Vector4::operator[](int i)
+float Matrix4x4::Cofactor(const Matrix4x4& a, int i, int j)
 {
-	switch (i) {
-	case 0: return x;
-	case 1: return y;
-	case 2: return z;
-	case 3: return w;
+	int sign = (i + j) % 2 == 0 ? 1 : -1;
+	float m[3][3];
+	for (int im = 0; im < 3; im++)
+	{
+		for (int jm = 0; jm < 3; jm++)
+		{
+			int ia = im;
+			if (ia >= i) ia++;
+			int ja = jm;
+			if (ja >= j) ja++;
+			m[im][jm] = a.data[ia][ja];
+		}
 	}
-	throw "out of range!";
-}
-
-Vector4::operator Vector3()
-{
-	return Vector3(x, y, z);
+	return sign * Det3x3(m);
 }
 
-float Vector4::Dot(Vector4 a, Vector4 b)
-{
-	float sum = 0.f;
-	for (int i = 0; i < 4; i++) {
-		sum += a[i] * b[i];
+// 2x2 minors of rows 0-1 (s) and rows 2-3 (c), every cofactor and the determinant are built from these 12
+struct Minors2x2 {
+	float s[6], c[6];
+
+	Minors2x2(const Matrix4x4& a) {
+		auto m = a.data;
+		s[0] = m[0][0] * m[1][1] - m[1][0] * m[0][1];
+		s[1] = m[0][0] * m[1][2] - m[1][0] * m[0][2];
+		s[2] = m[0][0] * m[1][3] - m[1][0] * m[0][3];
+		s[3] = m[0][1] * m[1][2] - m[1][1] * m[0][2];
+		s[4] = m[0][1] * m[1][3] - m[1][1] * m[0][3];
+		s[5] = m[0][2] * m[1][3] - m[1][2] * m[0][3];
+		c[5] = m[2][2] * m[3][3] - m[3][2] * m[2][3];
+		c[4] = m[2][1] * m[3][3] - m[3][1] * m[2][3];
+		c[3] = m[2][1] * m[3][2] - m[3][1] * m[2][2];
+		c[2] = m[2][0] * m[3][3] - m[3][0] * m[2][3];
+		c[1] = m[2][0] * m[3][2] - m[3][0] * m[2][2];
+		c[0] = m[2][0] * m[3][1] - m[3][0] * m[2][1];
 	}
-	return sum;
-}
 
-#pragma endregion
-
-#pragma region Matrix
-
-Matrix4x4 operator*(Matrix4x4& a, Matrix4x4& b)
-{
-	Matrix4x4 ret;
-	for (int i = 0; i < 4; i++)
+	float det() const {
+		return s[0] * c[5] - s[1] * c[4] + s[2] * c[3] + s[3] * c[2] - s[4] * c[1] + s[5] * c[0];
+	}
+};
+
+float Matrix4x4::Det(const Matrix4x4& a)
+{
+	return Minors2x2(a).det();
+}
+
+Matrix4x4 Matrix4x4::Adjugate(const Matrix4x4& a)
+{
+	Minors2x2 k(a);
+	auto s = k.s;
+	auto c = k.c;
+	auto m = a.data;
+	float r[4][4] = {
+		{ m[1][1] * c[5] - m[1][2] * c[4] + m[1][3] * c[3],
+		-m[0][1] * c[5] + m[0][2] * c[4] - m[0][3] * c[3],
+		m[3][1] * s[5] - m[3][2] * s[4] + m[3][3] * s[3],
+		-m[2][1] * s[5] + m[2][2] * s[4] - m[2][3] * s[3] },
+		{ -m[1][0] * c[5] + m[1][2] * c[2] - m[1][3] * c[1],
+		m[0][0] * c[5] - m[0][2] * c[2] + m[0][3] * c[1],
+		-m[3][0] * s[5] + m[3][2] * s[2] - m[3][3] * s[1],
+		m[2][0] * s[5] - m[2][2] * s[2] + m[2][3] * s[1] },
+		{ m[1][0] * c[4] - m[1][1] * c[2] + m[1][3] * c[0],
+		-m[0][0] * c[4] + m[0][1] * c[2] - m[0][3] * c[0],
+		m[3][0] * s[4] - m[3][1] * s[2] + m[3][3] * s[0],
+		-m[2][0] * s[4] + m[2][1] * s[2] - m[2][3] * s[0] },
+		{ -m[1][0] * c[3] + m[1][1] * c[1] - m[1][2] * c[0],
+		m[0][0] * c[3] - m[0][1] * c[1] + m[0][2] * c[0],
+		-m[3][0] * s[3] + m[3][1] * s[1] - m[3][2] * s[0],
+		m[2][0] * s[3] - m[2][1] * s[1] + m[2][2] * s[0] },
+	};
+	return Matrix4x4(r);
+}
+
+Matrix4x4 Matrix4x4::Invert(const Matrix4x4& a)
+{
+	auto adj = Adjugate(a);
+	float invDet = 1 / Minors2x2(a).det();
+	for (auto& row : adj.data)
 	{
-		for (int j = 0; j < 4; j++)
-		{
-			float sum = 0;
-			for (int k = 0; k < 4; k++)
-			{
-				sum += a.data[i][k] * b.data[k][j];
-			}
-			ret.data[i][j] = sum;
-		}
+		for (auto& v : row) v *= invDet;
 	}
-	return ret;
+	return adj;
 }
 
-Matrix4x4 operator/(Matrix4x4& a, float b)
+Matrix4x4 Matrix4x4::Transpose(const Matrix4x4& a)
 {
 	Matrix4x4 ret;
 	for (int i = 0; i < 4; i++)
 	{
 		for (int j = 0; j < 4; j++)
 		{
-			ret.data[i][j] = a.data[i][j] / b;
+			ret.data[i][j] = a.data[j][i];
 		}
 	}
 	return ret;
 }
 
-Vector4 operator*(Matrix4x4& lhs, Vector4& rhs)
+Affine3x4 Affine3x4::Inverse() const
 {
-	Vector4 ret;
-	for (int i = 0; i < 4; i++) {
-		ret[i] = Vector4::Dot(lhs.Row(i), rhs);
+	Vector3 c0(data[0][0], data[1][0], data[2][0]);
+	Vector3 c1(data[0][1], data[1][1], data[2][1]);
+	Vector3 c2(data[0][2], data[1][2], data[2][2]);
+	Vector3 rows[3] = { Vector3::Cross(c1, c2), Vector3::Cross(c2, c0), Vector3::Cross(c0, c1) };
+	float invDet = 1 / Vector3::Dot(c0, rows[0]);
+
+	Affine3x4 ret;
+	Vector3 t(data[0][3], data[1][3], data[2][3]);
+	for (int i = 0; i < 3; i++)
+	{
+		auto r = rows[i] * invDet;
+		ret.data[i][0] = r.x;
+		ret.data[i][1] = r.y;
+		ret.data[i][2] = r.z;
+		ret.data[i][3] = -Vector3::Dot(r, t);
 	}
 	return ret;
 }
 
-float Matrix4x4::Det3x3(float m[][3]) {
-	return
-		m[0][0] * m[1][1] * m[2][2] + m[0][1] * m[1][2] * m[2][0] + m[0][2] * m[1][0] * m[2][1]
-		- m[0][2] * m[1][1] * m[2][0] - m[0][1] * m[1][0] * m[2][2] - m[0][0] * m[1][2] * m[2][1];
-}
-float Matrix4x4::Cofactor(Matrix4x4& a, int i, int j)
+Affine3x4 Affine3x4::NormalMatrix() const
 {
-	int sign = (i + j) % 2 == 0 ? 1 : -1;
-	float m[3][3];
-	for (int im = 0; im < 3; im++)
+	auto inv = Inverse();
+	Affine3x4 ret;
+	for (int i = 0; i < 3; i++)
 	{
-		for (int jm = 0; jm < 3; jm++)
+		for (int j = 0; j < 3; j++)
 		{
-			int ia = im;
-			if (ia >= i) ia++;
-			int ja = jm;
-			if (ja >= j) ja++;
-			m[im][jm] = a.data[ia][ja];
+			ret.data[i][j] = inv.data[j][i];
 		}
 	}
-	return sign * Det3x3(m);
+	return ret;
 }
 
-float Matrix4x4::Det(Matrix4x4& a)
+#pragma endregion
+
+#pragma region Batch transforms
+
+#if MATH_SIMD
+// four packed Vector3 (12 floats in a, b, c) <-> one register per component
+static inline void loadVector3x4(const Vector3* p, __m128& x, __m128& y, __m128& z)
 {
-	float ret = 0;
-	for (int i = 0; i < 4; i++)
-	{
-		ret += a.data[0][i] * Cofactor(a, 0, i);
-	}
-	return ret;
+	const float* f = &p->x;
+	__m128 a = _mm_loadu_ps(f), b = _mm_loadu_ps(f + 4), c = _mm_loadu_ps(f + 8);
+	x = _mm_shuffle_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 3, 0, 0)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0));
+	y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+	z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
 }
 
-Matrix4x4 Matrix4x4::Adjugate(Matrix4x4& a)
+static inline void storeVector3x4(Vector3* p, __m128 x, __m128 y, __m128 z)
 {
-	Matrix4x4 ret;
-	for (int i = 0; i < 4; i++)
-	{
-		for (int j = 0; j < 4; j++)
-		{
-			ret.data[i][j] = Cofactor(a, i, j);
-		}
-	}
-	return Transpose(ret);
+	float* f = &p->x;
+	_mm_storeu_ps(f, _mm_shuffle_ps(_mm_shuffle_ps(x, y, _MM_SHUFFLE(0, 0, 0, 0)), _mm_shuffle_ps(z, x, _MM_SHUFFLE(1, 1, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0)));
+	_mm_storeu_ps(f + 4, _mm_shuffle_ps(_mm_shuffle_ps(y, z, _MM_SHUFFLE(1, 1, 1, 1)), _mm_shuffle_ps(x, y, _MM_SHUFFLE(2, 2, 2, 2)), _MM_SHUFFLE(2, 0, 2, 0)));
+	_mm_storeu_ps(f + 8, _mm_shuffle_ps(_mm_shuffle_ps(z, x, _MM_SHUFFLE(3, 3, 2, 2)), _mm_shuffle_ps(y, z, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0)));
 }
 
-Matrix4x4 Matrix4x4::Invert(Matrix4x4& a)
+// row . (x, y, z) for four points, plus the translation column when it is given
+static inline __m128 affineRow(const float* row, __m128 x, __m128 y, __m128 z, bool point)
 {
-	return Adjugate(a) / Det(a);
+	__m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(row[0]), x), _mm_mul_ps(_mm_set1_ps(row[1]), y)), _mm_mul_ps(_mm_set1_ps(row[2]), z));
+	return point ? _mm_add_ps(r, _mm_set1_ps(row[3])) : r;
 }
 
-Matrix4x4 Matrix4x4::Transpose(Matrix4x4& a)
+static void transformAffine(const Affine3x4& m, const Vector3* in, Vector3* out, size_t count, bool point)
 {
-	Matrix4x4 ret;
-	for (int i = 0; i < 4; i++)
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
 	{
-		for (int j = 0; j < 4; j++)
-		{
-			ret.data[i][j] = a.data[j][i];
-		}
+		__m128 x, y, z;
+		loadVector3x4(in + i, x, y, z);
+		storeVector3x4(out + i, affineRow(m.data[0], x, y, z, point), affineRow(m.data[1], x, y, z, point), affineRow(m.data[2], x, y, z, point));
 	}
-	return ret;
+	for (; i < count; i++) out[i] = point ? m.TransformPoint(in[i]) : m.TransformDir(in[i]);
 }
 
-Matrix4x4::Matrix4x4(const float data[4][4]) {
-	for (int i = 0; i < 4; i++)
+void TransformPoints(const Matrix4x4& m, const Vector3* in, Vector4* out, size_t count)
+{
+	// columns of m, each output is one multiply-add chain over them
+	__m128 c0 = _mm_loadu_ps(m.data[0]), c1 = _mm_loadu_ps(m.data[1]);
+	__m128 c2 = _mm_loadu_ps(m.data[2]), c3 = _mm_loadu_ps(m.data[3]);
+	_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+	for (size_t i = 0; i < count; i++)
 	{
-		for (int j = 0; j < 4; j++)
-		{
-			this->data[i][j] = data[i][j];
-		}
+		__m128 r = _mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(in[i].x)), _mm_mul_ps(c1, _mm_set1_ps(in[i].y)));
+		r = _mm_add_ps(_mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(in[i].z))), c3);
+		_mm_storeu_ps(&out[i].x, r);
 	}
 }
-
-Vector4 Matrix4x4::Row(int i)
+#else
+static void transformAffine(const Affine3x4& m, const Vector3* in, Vector3* out, size_t count, bool point)
 {
-	return Vector4(data[i][0], data[i][1], data[i][2], data[i][3]);
+	for (size_t i = 0; i < count; i++) out[i] = point ? m.TransformPoint(in[i]) : m.TransformDir(in[i]);
 }
 
-Matrix4x4 Matrix4x4::Inverse()
+void TransformPoints(const Matrix4x4& m, const Vector3* in, Vector4* out, size_t count)
 {
-	return Matrix4x4::Invert(*this);
+	for (size_t i = 0; i < count; i++) out[i] = m * Vector4(in[i].x, in[i].y, in[i].z, 1);
 }
+#endif
 
-Matrix4x4 Matrix4x4::Transpose()
+void TransformPoints(const Affine3x4& m, const Vector3* in, Vector3* out, size_t count)
 {
-	return Transpose(*this);
+	transformAffine(m, in, out, count, true);
 }
 
-Matrix4x4::Matrix4x4()
+void TransformDirs(const Affine3x4& m, const Vector3* in, Vector3* out, size_t count)
 {
+	transformAffine(m, in, out, count, false);
 }
 
 #pragma endregion
-
-
@@ -1,85 +1,214 @@
 #include <math.h>
+#include <string.h>
 
 #pragma once
 
+// SSE2 is part of every x64 target, the matrix products use it when it is there
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define MATH_SIMD 1
+#include <emmintrin.h>
+#else
+#define MATH_SIMD 0
+#endif
 
+// The small vector and matrix operations are inline so they fold into the callers' loops.
+// Sums are accumulated left to right like the scalar loops, so the SIMD paths give the same results.
 
 struct Vector2 {
 	float x, y;
 
 	Vector2() {}
-	Vector2(float x, float y);
-	float Magnitude();
-	Vector2 Normalized();
-	static float Dot(Vector2 a, Vector2 b);
+	Vector2(float x, float y) :x(x), y(y) {}
+	float Magnitude() const { return sqrtf(x * x + y * y); }
+	Vector2 Normalized() const {
+		auto m = Magnitude();
+		return Vector2(x / m, y / m);
+	}
+	static float Dot(Vector2 a, Vector2 b) { return a.x * b.x + a.y * b.y; }
 };
-Vector2 operator +(Vector2 a, Vector2 b);
-Vector2 operator *(float a, Vector2 b);
-Vector2 operator -(Vector2 a);
-Vector2 operator -(Vector2 a, Vector2 b);
+inline Vector2 operator +(Vector2 a, Vector2 b) { return Vector2(a.x + b.x, a.y + b.y); }
+inline Vector2 operator *(float a, Vector2 b) { return Vector2(a * b.x, a * b.y); }
+inline Vector2 operator -(Vector2 a) { return Vector2(-a.x, -a.y); }
+inline Vector2 operator -(Vector2 a, Vector2 b) { return Vector2(a.x - b.x, a.y - b.y); }
 
 struct Vector2Int
 {
 	int x, y;
 
 	Vector2Int() {}
-	Vector2Int(int x, int y);
-	operator Vector2();
+	Vector2Int(int x, int y) :x(x), y(y) {}
+	operator Vector2() const { return Vector2((float)x, (float)y); }
 };
 
 struct Vector3
 {
 	float x, y, z;
 	Vector3() {}
-	Vector3(float x, float y, float z);
-	float Magnitude();
-	Vector3 Normalized();
-	operator Vector2();
-
-	static Vector3 Zero();
-	static Vector3 Back();
-	static Vector3 Forward();
-	static float Dot(Vector3 a, Vector3 b);
-	static Vector3 Cross(Vector3 lhs, Vector3 rhs);
-
+	Vector3(float x, float y, float z) :x(x), y(y), z(z) {}
+	float Magnitude() const { return sqrtf(x * x + y * y + z * z); }
+	Vector3 Normalized() const {
+		auto m = Magnitude();
+		return Vector3(x / m, y / m, z / m);
+	}
+	operator Vector2() const { return Vector2(x, y); }
+
+	static Vector3 Zero() { return Vector3(0, 0, 0); }
+	static Vector3 Back() { return Vector3(0, 0, -1); }
+	static Vector3 Forward() { return Vector3(0, 0, 1); }
+	static float Dot(Vector3 a, Vector3 b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+	static Vector3 Cross(Vector3 lhs, Vector3 rhs) {
+		return Vector3(lhs.y * rhs.z - rhs.y * lhs.z,
+			-(lhs.x * rhs.z - rhs.x * lhs.z),
+			lhs.x * rhs.y - rhs.x * lhs.y);
+	}
 };
-Vector3 operator /(Vector3 a, float b);
-Vector3 operator -(Vector3 a);
-Vector3 operator -(Vector3 a, Vector3 b);
-Vector3 operator +(Vector3 a, Vector3 b);
-Vector3 operator *(float a, Vector3 b);
-Vector3 operator *(Vector3 b, float a);
+inline Vector3 operator /(Vector3 a, float b) { return Vector3(a.x / b, a.y / b, a.z / b); }
+inline Vector3 operator -(Vector3 a) { return Vector3(-a.x, -a.y, -a.z); }
+inline Vector3 operator -(Vector3 a, Vector3 b) { return Vector3(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline Vector3 operator +(Vector3 a, Vector3 b) { return Vector3(a.x + b.x, a.y + b.y, a.z + b.z); }
+inline Vector3 operator *(float a, Vector3 b) { return Vector3(a * b.x, a * b.y, a * b.z); }
+inline Vector3 operator *(Vector3 b, float a) { return Vector3(a * b.x, a * b.y, a * b.z); }
 
 struct Vector4
 {
 	float x, y, z, w;
-	Vector4();
-	Vector4(float x, float y, float z, float w);
-	float& operator[](int i);
-	operator Vector3();
-
-	static float Dot(Vector4 a, Vector4 b);
+	Vector4() {}
+	Vector4(float x, float y, float z, float w) :x(x), y(y), z(z), w(w) {}
+	float& operator[](int i) { return (&x)[i]; }
+	float operator[](int i) const { return (&x)[i]; }
+	operator Vector3() const { return Vector3(x, y, z); }
 
+	static float Dot(const Vector4& a, const Vector4& b) { return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w; }
 };
 
+// row-major, transforms column vectors: v' = M * v
 struct Matrix4x4 {
 	float data[4][4] = {};
-	Matrix4x4();
-	Matrix4x4(const float data[4][4]);
-	Vector4 Row(int i);
-	Matrix4x4 Inverse();
-	Matrix4x4 Transpose();
-
-	static float Cofactor(Matrix4x4& a, int i, int j);
-	static float Det3x3(float m[][3]);
-	static float Det(Matrix4x4& a);
-	static Matrix4x4 Adjugate(Matrix4x4& a);
-	static Matrix4x4 Invert(Matrix4x4& a);
-	static Matrix4x4 Transpose(Matrix4x4& a);
+	Matrix4x4() {}
+	Matrix4x4(const float data[4][4]) { memcpy(this->data, data, sizeof(this->data)); }
+	Vector4 Row(int i) const { return Vector4(data[i][0], data[i][1], data[i][2], data[i][3]); }
+	Matrix4x4 Inverse() const { return Invert(*this); }
+	Matrix4x4 Transpose() const { return Transpose(*this); }
+
+	static float Cofactor(const Matrix4x4& a, int i, int j);
+	static float Det3x3(const float m[][3]);
+	static float Det(const Matrix4x4& a);
+	static Matrix4x4 Adjugate(const Matrix4x4& a);
+	// closed form from the 2x2 minors of the top and bottom row pairs
+	static Matrix4x4 Invert(const Matrix4x4& a);
+	static Matrix4x4 Transpose(const Matrix4x4& a);
 };
-Matrix4x4 operator*(Matrix4x4& a, Matrix4x4& b);
-Vector4 operator*(Matrix4x4& m, Vector4& v);
-Matrix4x4 operator/(Matrix4x4& a, float b);
-
 
+inline Matrix4x4 operator*(const Matrix4x4& a, const Matrix4x4& b)
+{
+	Matrix4x4 ret;
+#if MATH_SIMD
+	// row i of the product is the rows of b weighted by row i of a
+	__m128 b0 = _mm_loadu_ps(b.data[0]), b1 = _mm_loadu_ps(b.data[1]);
+	__m128 b2 = _mm_loadu_ps(b.data[2]), b3 = _mm_loadu_ps(b.data[3]);
+	for (int i = 0; i < 4; i++)
+	{
+		__m128 r = _mm_mul_ps(_mm_set1_ps(a.data[i][0]), b0);
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a.data[i][1]), b1));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a.data[i][2]), b2));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a.data[i][3]), b3));
+		_mm_storeu_ps(ret.data[i], r);
+	}
+#else
+	for (int i = 0; i < 4; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			ret.data[i][j] = a.data[i][0] * b.data[0][j] + a.data[i][1] * b.data[1][j] + a.data[i][2] * b.data[2][j] + a.data[i][3] * b.data[3][j];
+		}
+	}
+#endif
+	return ret;
+}
+
+inline Vector4 operator*(const Matrix4x4& m, const Vector4& v)
+{
+#if MATH_SIMD
+	// the four row products, transposed so one add chain sums all rows at once
+	__m128 vv = _mm_loadu_ps(&v.x);
+	__m128 r0 = _mm_mul_ps(_mm_loadu_ps(m.data[0]), vv);
+	__m128 r1 = _mm_mul_ps(_mm_loadu_ps(m.data[1]), vv);
+	__m128 r2 = _mm_mul_ps(_mm_loadu_ps(m.data[2]), vv);
+	__m128 r3 = _mm_mul_ps(_mm_loadu_ps(m.data[3]), vv);
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	Vector4 ret;
+	_mm_storeu_ps(&ret.x, _mm_add_ps(_mm_add_ps(_mm_add_ps(r0, r1), r2), r3));
+	return ret;
+#else
+	return Vector4(Vector4::Dot(m.Row(0), v), Vector4::Dot(m.Row(1), v), Vector4::Dot(m.Row(2), v), Vector4::Dot(m.Row(3), v));
+#endif
+}
+
+inline Matrix4x4 operator/(const Matrix4x4& a, float b)
+{
+	Matrix4x4 ret;
+	for (int i = 0; i < 4; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			ret.data[i][j] = a.data[i][j] / b;
+		}
+	}
+	return ret;
+}
+
+// the top three rows of an affine Matrix4x4, whose bottom row is 0 0 0 1.
+// Points and directions go through 9 multiplies and no homogeneous divide.
+struct Affine3x4 {
+	float data[3][4] = {};
+	Affine3x4() {}
+	// drops the bottom row, which must be 0 0 0 1
+	explicit Affine3x4(const Matrix4x4& m) { memcpy(data, m.data, sizeof(data)); }
+	Matrix4x4 ToMatrix() const {
+		Matrix4x4 m;
+		memcpy(m.data, data, sizeof(data));
+		m.data[3][3] = 1;
+		return m;
+	}
+
+	Vector3 TransformPoint(const Vector3& p) const {
+		return Vector3(data[0][0] * p.x + data[0][1] * p.y + data[0][2] * p.z + data[0][3],
+			data[1][0] * p.x + data[1][1] * p.y + data[1][2] * p.z + data[1][3],
+			data[2][0] * p.x + data[2][1] * p.y + data[2][2] * p.z + data[2][3]);
+	}
+	Vector3 TransformDir(const Vector3& d) const {
+		return Vector3(data[0][0] * d.x + data[0][1] * d.y + data[0][2] * d.z,
+			data[1][0] * d.x + data[1][1] * d.y + data[1][2] * d.z,
+			data[2][0] * d.x + data[2][1] * d.y + data[2][2] * d.z);
+	}
+	float Det() const {
+		return data[0][0] * (data[1][1] * data[2][2] - data[1][2] * data[2][1])
+			- data[0][1] * (data[1][0] * data[2][2] - data[1][2] * data[2][0])
+			+ data[0][2] * (data[1][0] * data[2][1] - data[1][1] * data[2][0]);
+	}
+	// the rows of the 3x3 inverse are the cross products of its columns over the determinant
+	Affine3x4 Inverse() const;
+	// inverse transpose of the 3x3 part, the matrix for normals; the translation is dropped
+	Affine3x4 NormalMatrix() const;
+};
 
+inline Affine3x4 operator*(const Affine3x4& a, const Affine3x4& b)
+{
+	Affine3x4 ret;
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			ret.data[i][j] = a.data[i][0] * b.data[0][j] + a.data[i][1] * b.data[1][j] + a.data[i][2] * b.data[2][j];
+		}
+		ret.data[i][3] += a.data[i][3];
+	}
+	return ret;
+}
+
+// batch transforms over arrays. With SSE2 the affine ones take four elements per step, the projective one
+// keeps the matrix columns in registers and takes one point per step; scalar loops otherwise.
+// in and out must not overlap unless they are the same array.
+void TransformPoints(const Matrix4x4& m, const Vector3* in, Vector4* out, size_t count); // out = m * (p, 1), no divide
+void TransformPoints(const Affine3x4& m, const Vector3* in, Vector3* out, size_t count);
+void TransformDirs(const Affine3x4& m, const Vector3* in, Vector3* out, size_t count);    // not normalized
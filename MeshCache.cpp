@@ -0,0 +1,206 @@
+#include "MeshCache.h"
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+#ifdef _WIN32
+bool MappedFile::open(const string& path)
+{
+	close();
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		file = nullptr;
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+		close();
+		return false;
+	}
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping) {
+		close();
+		return false;
+	}
+	ptr = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	if (!ptr) {
+		close();
+		return false;
+	}
+	length = (size_t)fileSize.QuadPart;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (ptr) UnmapViewOfFile(ptr);
+	if (mapping) CloseHandle(mapping);
+	if (file) CloseHandle(file);
+	ptr = nullptr;
+	mapping = nullptr;
+	file = nullptr;
+	length = 0;
+}
+#else
+bool MappedFile::open(const string& path)
+{
+	close();
+	fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close();
+		return false;
+	}
+	void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		close();
+		return false;
+	}
+	ptr = static_cast<const uint8_t*>(p);
+	length = (size_t)st.st_size;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (ptr) munmap(const_cast<uint8_t*>(ptr), length);
+	if (fd >= 0) ::close(fd);
+	ptr = nullptr;
+	fd = -1;
+	length = 0;
+}
+#endif
+
+// 64 bit words through a multiply-xorshift mix, fast enough to verify a large cache on every load
+uint64_t checksum64(const void* data, size_t size)
+{
+	auto p = static_cast<const uint8_t*>(data);
+	uint64_t h = 0x9E3779B97F4A7C15ull ^ size;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, p + i, 8);
+		h = (h ^ word) * 0xFF51AFD7ED558CCDull;
+		h ^= h >> 32;
+	}
+	uint64_t tail = 0;
+	for (size_t j = 0; i + j < size; j++) tail |= (uint64_t)p[i + j] << (j * 8);
+	h = (h ^ tail) * 0xC4CEB9FE1A85EC53ull;
+	return h ^ (h >> 29);
+}
+
+static uint64_t alignUp(uint64_t v)
+{
+	return (v + CMESH_ALIGN - 1) / CMESH_ALIGN * CMESH_ALIGN;
+}
+
+bool MeshCache::write(const string& path, uint64_t sourceSize, int64_t sourceTime, const vector<Array>& arrays)
+{
+	CMeshHeader header{};
+	header.magic = CMESH_MAGIC;
+	header.version = CMESH_VERSION;
+	header.sectionCount = (uint32_t)arrays.size();
+	header.sourceSize = sourceSize;
+	header.sourceTime = sourceTime;
+
+	vector<CMeshSection> table(arrays.size());
+	uint64_t offset = alignUp(sizeof(CMeshHeader) + sizeof(CMeshSection) * table.size());
+	for (size_t i = 0; i < arrays.size(); i++) {
+		auto& a = arrays[i];
+		table[i].id = (uint32_t)i;
+		table[i].elemSize = a.elemSize;
+		table[i].offset = offset;
+		table[i].count = a.count;
+		table[i].checksum = checksum64(a.data, (size_t)(a.elemSize * a.count));
+		offset = alignUp(offset + a.elemSize * a.count);
+	}
+	header.tableChecksum = checksum64(table.data(), sizeof(CMeshSection) * table.size());
+
+	auto tmpPath = path + ".tmp";
+	ofstream out(tmpPath, ios::binary);
+	if (!out.is_open()) {
+		cerr << "can't open file " << tmpPath << "\n";
+		return false;
+	}
+	const char zeros[CMESH_ALIGN] = {};
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(table.data()), sizeof(CMeshSection) * table.size());
+	uint64_t pos = sizeof(header) + sizeof(CMeshSection) * table.size();
+	for (size_t i = 0; i < arrays.size(); i++) {
+		out.write(zeros, (streamsize)(table[i].offset - pos));
+		auto bytes = arrays[i].elemSize * arrays[i].count;
+		out.write(static_cast<const char*>(arrays[i].data), (streamsize)bytes);
+		pos = table[i].offset + bytes;
+	}
+	out.close();
+	if (!out.good()) {
+		cerr << "can't write the mesh cache " << tmpPath << "\n";
+		remove(tmpPath.c_str());
+		return false;
+	}
+
+	remove(path.c_str());
+	if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+		cerr << "can't write the mesh cache " << path << "\n";
+		remove(tmpPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool MeshCache::open(const string& path, uint64_t sourceSize, int64_t sourceTime)
+{
+	close();
+	if (!file.open(path)) return false;
+
+	auto fail = [&](const char* reason) {
+		cerr << "ignoring mesh cache " << path << ": " << reason << "\n";
+		close();
+		return false;
+	};
+	if (file.size() < sizeof(CMeshHeader)) return fail("truncated");
+	CMeshHeader header;
+	memcpy(&header, file.data(), sizeof(header));
+	if (header.magic != CMESH_MAGIC) return fail("not a mesh cache");
+	if (header.version != CMESH_VERSION) return fail("old version");
+	if (header.sourceSize != sourceSize || header.sourceTime != sourceTime) return fail("source changed");
+
+	uint64_t tableBytes = sizeof(CMeshSection) * (uint64_t)header.sectionCount;
+	if (file.size() < sizeof(CMeshHeader) + tableBytes) return fail("truncated");
+	auto table = file.data() + sizeof(CMeshHeader);
+	if (checksum64(table, (size_t)tableBytes) != header.tableChecksum) return fail("bad checksum");
+
+	sections.resize(header.sectionCount);
+	memcpy(sections.data(), table, (size_t)tableBytes);
+	for (uint32_t i = 0; i < header.sectionCount; i++) {
+		auto& s = sections[i];
+		if (s.id != i || s.offset % CMESH_ALIGN != 0) return fail("bad section table");
+		if (s.elemSize == 0 || s.offset > file.size() || s.count > (file.size() - s.offset) / s.elemSize) return fail("truncated");
+		if (checksum64(file.data() + s.offset, (size_t)(s.elemSize * s.count)) != s.checksum) return fail("bad checksum");
+	}
+	return true;
+}
+
+void MeshCache::close()
+{
+	file.close();
+	sections.clear();
+}
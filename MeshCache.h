@@ -0,0 +1,108 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// non-owning view of a contiguous array: a vector's storage or a section of a mapped file
+template<class T>
+class ArrayView {
+public:
+	ArrayView() : ptr(nullptr), count(0) {}
+	ArrayView(const T* ptr, size_t count) : ptr(ptr), count(count) {}
+	ArrayView(const vector<T>& v) : ptr(v.data()), count(v.size()) {}
+
+	const T& operator[](size_t i) const { return ptr[i]; }
+	const T* data() const { return ptr; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const T* begin() const { return ptr; }
+	const T* end() const { return ptr + count; }
+
+private:
+	const T* ptr;
+	size_t count;
+};
+
+// read-only memory mapping of a whole file
+class MappedFile {
+public:
+	MappedFile() = default;
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const string& path);
+	void close();
+	const uint8_t* data() const { return ptr; }
+	size_t size() const { return length; }
+
+private:
+	const uint8_t* ptr = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	void* file = nullptr;
+	void* mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+};
+
+// .cmesh: binary cache of a parsed mesh, written next to the .obj and mapped in place on later loads.
+// Layout: CMeshHeader, CMeshSection[sectionCount], then the data of each section, 16 byte aligned.
+// The cache is stale when the source file's size or write time differs from the stamp in the header.
+#define CMESH_MAGIC 0x48534D43 // "CMSH"
+#define CMESH_VERSION 3 // 2: facet indices are 16 bit when they fit, 3: vertex tangents
+#define CMESH_ALIGN 16
+
+struct CMeshHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sectionCount;
+	uint32_t reserved;
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	uint64_t tableChecksum; // over the section table
+};
+
+struct CMeshSection {
+	uint32_t id;
+	uint32_t elemSize;
+	uint64_t offset; // from the start of the file
+	uint64_t count;
+	uint64_t checksum;
+};
+
+uint64_t checksum64(const void* data, size_t size);
+
+class MeshCache {
+public:
+	// one array to store, its index in the list is its section id
+	struct Array {
+		const void* data;
+		uint32_t elemSize;
+		uint64_t count;
+	};
+
+	// writes to a temporary file first, so a failed write never leaves a truncated cache behind
+	static bool write(const string& path, uint64_t sourceSize, int64_t sourceTime, const vector<Array>& arrays);
+
+	// maps the cache and checks magic, version, source stamp, section bounds and checksums
+	bool open(const string& path, uint64_t sourceSize, int64_t sourceTime);
+	void close();
+
+	// view of a section, false if it is missing or stores a different element type
+	template<class T>
+	bool get(uint32_t id, ArrayView<T>& view) const {
+		if (id >= sections.size() || sections[id].elemSize != sizeof(T)) return false;
+		auto& s = sections[id];
+		view = ArrayView<T>(reinterpret_cast<const T*>(file.data() + s.offset), (size_t)s.count);
+		return true;
+	}
+
+private:
+	MappedFile file;
+	vector<CMeshSection> sections;
+};
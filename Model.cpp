@@ -1,83 +1,215 @@
 
 #include "Model.h";
+#include <unordered_map>
+#include <cmath>
 
-using namespace std::experimental::filesystem::v1;
-using namespace filesystem;
+using namespace std::filesystem;
 using namespace std;
 
-static bool startWith(const string& s, const string& s1) {
-	return s.compare(0, s1.length(), s1) == 0;
-}
+// section ids of the arrays in the .cmesh cache
+enum MeshSection { SECTION_VERTS, SECTION_UV, SECTION_NORMALS, SECTION_UNIQUE_VERTS, SECTION_FACET_UNIQUE_VERTS, SECTION_TANGENTS, SECTION_COUNT };
 
-static Color32 getColorWithUV(const TGAImage& img, const float u, const float v) {
-	auto x = img.get_width() * u;
-	auto y = img.get_height() * v;
-	return img.get(x, y);
+void Model::readObjFile(string file)
+{
+	ObjMesh mesh;
+	if (!readObj(file, mesh)) return;
+	vertData = move(mesh.verts);
+	uvData = move(mesh.uv);
+	normalData = move(mesh.normals);
+	corners = move(mesh.corners);
 }
 
-void Model::readObjFile(string file)
+void Model::buildUniqueVerts()
 {
-	ifstream in(file);
-	if (in.fail())return;
-	string line;
-	while (!in.eof())
-	{
-		getline(in, line);
-		stringstream ss (line);
-		if (startWith(line, "v ")) {
-			ss.ignore(2);
-			float x, y, z;
-			ss >> x >> y >> z;
-			verts.push_back(Vector3( x, y, z ));
+	struct VertIndexHash {
+		size_t operator()(const VertIndex& v) const {
+			return ((size_t)v.pos * 73856093u) ^ ((size_t)v.uv * 19349663u) ^ ((size_t)v.normal * 83492791u);
 		}
-		else if (startWith(line, "vt ")) {
-			ss.ignore(3);
-			float u,v;
-			ss >> u >> v;
-			uv.push_back(Vector2(u, v));
+	};
+	unordered_map<VertIndex, int, VertIndexHash> lookup;
+	lookup.reserve(vertData.size());
+	uniqueVertData.clear();
+	facetIndex32Data.resize(corners.size());
+	for (size_t i = 0; i < corners.size(); i++)
+	{
+		auto& key = corners[i];
+		auto it = lookup.find(key);
+		if (it == lookup.end()) {
+			it = lookup.emplace(key, (int)uniqueVertData.size()).first;
+			uniqueVertData.push_back(key);
 		}
-		else if (startWith(line, "vn ")) {
-			ss.ignore(3);
-			float x, y, z;
-			ss >> x >> y >> z;
-			normals.push_back(Vector3(x, y, z));
+		facetIndex32Data[i] = it->second;
+	}
+	if (uniqueVertData.size() <= 0x10000) {
+		facetIndex16Data.assign(facetIndex32Data.begin(), facetIndex32Data.end());
+		vector<uint32_t>().swap(facetIndex32Data);
+	}
+	// the facets are fully described by the unique verts now
+	vector<VertIndex>().swap(corners);
+}
+
+// an arbitrary unit vector orthogonal to n
+static Vector3 anyOrthogonal(Vector3 n)
+{
+	auto axis = fabs(n.x) < 0.9f ? Vector3(1, 0, 0) : Vector3(0, 1, 0);
+	return Vector3::Cross(n, axis).Normalized();
+}
+
+// v minus its component along the unit vector n
+static Vector3 rejectFrom(Vector3 v, Vector3 n)
+{
+	return v - Vector3::Dot(n, v) * n;
+}
+
+// tangent frames in the style of MikkTSpace: every facet corner adds the facet's uv tangent and bitangent,
+// projected into the plane of the corner's normal, normalized and weighted by the corner angle.
+// The sums are orthogonalized against the normal; the bitangent only survives as a handedness sign.
+void Model::buildTangents()
+{
+	size_t count = uniqueVerts.size();
+	vector<Vector3> tsum(count, Vector3(0, 0, 0));
+	vector<Vector3> bsum(count, Vector3(0, 0, 0));
+	for (int f = 0; f < facetCount(); f++)
+	{
+		int index[3];
+		Vector3 p[3], n[3];
+		Vector2 t[3];
+		for (int i = 0; i < 3; i++)
+		{
+			index[i] = uniqueVertIndex(f, i);
+			p[i] = uniqueVertPos(index[i]);
+			t[i] = uniqueVertUV(index[i]);
+			n[i] = uniqueVertNormal(index[i]).Normalized();
 		}
-		else if (startWith(line, "f ")) {
-			Facet f;
-			ss.ignore(2);
-			for (int i = 0; i < 3; i++)
-			{
-				ss >> f.verts[i];
-				f.verts[i]--;
-				ss.ignore(1);
-				ss >> f.uv[i];
-				f.uv[i]--;
-				ss.ignore(1);
-				ss >> f.normals[i];
-				f.normals[i]--;
-			}
-			facets.push_back(f);
+		auto dp1 = p[1] - p[0], dp2 = p[2] - p[0];
+		auto du1 = t[1] - t[0], du2 = t[2] - t[0];
+		float det = du1.x * du2.y - du1.y * du2.x;
+		// no uv mapping to follow
+		if (det == 0 || !isfinite(det)) continue;
+		auto faceT = (dp1 * du2.y - dp2 * du1.y) / det;
+		auto faceB = (dp2 * du1.x - dp1 * du2.x) / det;
+
+		for (int i = 0; i < 3; i++)
+		{
+			auto e1 = p[(i + 1) % 3] - p[i], e2 = p[(i + 2) % 3] - p[i];
+			float len = e1.Magnitude() * e2.Magnitude();
+			if (len == 0) continue;
+			float angle = acosf(max(-1.f, min(1.f, Vector3::Dot(e1, e2) / len)));
+			auto ct = rejectFrom(faceT, n[i]), cb = rejectFrom(faceB, n[i]);
+			float lt = ct.Magnitude(), lb = cb.Magnitude();
+			if (lt > 0) tsum[index[i]] = tsum[index[i]] + ct * (angle / lt);
+			if (lb > 0) bsum[index[i]] = bsum[index[i]] + cb * (angle / lb);
 		}
 	}
-	in.close();
+
+	tangentData.resize(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		auto n = uniqueVertNormal((int)i).Normalized();
+		auto t = rejectFrom(tsum[i], n);
+		float length = t.Magnitude();
+		t = length > 1e-12f ? t / length : anyOrthogonal(n);
+		float sign = Vector3::Dot(Vector3::Cross(n, t), bsum[i]) < 0 ? -1.f : 1.f;
+		tangentData[i] = Vector4(t.x, t.y, t.z, sign);
+	}
+}
+
+// prefer a valid .cmesh next to the .obj, otherwise parse the text and write the cache for the next load
+void Model::loadMesh(string objFile)
+{
+	auto cacheFile = path(objFile).replace_extension(".cmesh").string();
+	auto sourceSize = (uint64_t)file_size(objFile);
+	auto sourceTime = (int64_t)last_write_time(objFile).time_since_epoch().count();
+	if (readMeshCache(cacheFile, sourceSize, sourceTime)) return;
+
+	readObjFile(objFile);
+	buildUniqueVerts();
+	verts = vertData;
+	uv = uvData;
+	normals = normalData;
+	uniqueVerts = uniqueVertData;
+	facetUniqueVerts.index16 = facetIndex16Data;
+	facetUniqueVerts.index32 = facetIndex32Data;
+	buildTangents();
+	tangents = tangentData;
+	writeMeshCache(cacheFile, sourceSize, sourceTime);
+}
+
+bool Model::readMeshCache(string file, uint64_t sourceSize, int64_t sourceTime)
+{
+	if (!meshCache.open(file, sourceSize, sourceTime)) return false;
+	bool indices = meshCache.get(SECTION_FACET_UNIQUE_VERTS, facetUniqueVerts.index16)
+		|| meshCache.get(SECTION_FACET_UNIQUE_VERTS, facetUniqueVerts.index32);
+	if (indices && meshCache.get(SECTION_VERTS, verts) && meshCache.get(SECTION_UV, uv) && meshCache.get(SECTION_NORMALS, normals)
+		&& meshCache.get(SECTION_UNIQUE_VERTS, uniqueVerts) && meshCache.get(SECTION_TANGENTS, tangents) && validateMesh()) {
+		return true;
+	}
+	cerr << "ignoring mesh cache " << file << ": bad mesh data\n";
+	verts = {};
+	uv = {};
+	normals = {};
+	uniqueVerts = {};
+	facetUniqueVerts = {};
+	tangents = {};
+	meshCache.close();
+	return false;
+}
+
+// bounds check every index once, so the accessors don't have to.
+// Meshes from the parser are valid by construction, this guards the cache.
+bool Model::validateMesh()
+{
+	for (auto& v : uniqueVerts)
+	{
+		if (v.pos < 0 || v.pos >= (int)verts.size() || v.uv < 0 || v.uv >= (int)uv.size()
+			|| v.normal < 0 || v.normal >= (int)normals.size()) return false;
+	}
+	if (facetUniqueVerts.size() % 3 != 0 || tangents.size() != uniqueVerts.size()) return false;
+	for (size_t i = 0; i < facetUniqueVerts.size(); i++)
+	{
+		// 32 bit indices from 0x80000000 up read as negative
+		if (facetUniqueVerts[i] < 0 || facetUniqueVerts[i] >= (int)uniqueVerts.size()) return false;
+	}
+	return true;
+}
+
+void Model::writeMeshCache(string file, uint64_t sourceSize, int64_t sourceTime)
+{
+	vector<MeshCache::Array> arrays(SECTION_COUNT);
+	arrays[SECTION_VERTS] = { verts.data(), sizeof(Vector3), verts.size() };
+	arrays[SECTION_UV] = { uv.data(), sizeof(Vector2), uv.size() };
+	arrays[SECTION_NORMALS] = { normals.data(), sizeof(Vector3), normals.size() };
+	arrays[SECTION_UNIQUE_VERTS] = { uniqueVerts.data(), sizeof(VertIndex), uniqueVerts.size() };
+	if (!facetUniqueVerts.index16.empty())
+		arrays[SECTION_FACET_UNIQUE_VERTS] = { facetUniqueVerts.index16.data(), sizeof(uint16_t), facetUniqueVerts.index16.size() };
+	else
+		arrays[SECTION_FACET_UNIQUE_VERTS] = { facetUniqueVerts.index32.data(), sizeof(uint32_t), facetUniqueVerts.index32.size() };
+	arrays[SECTION_TANGENTS] = { tangents.data(), sizeof(Vector4), tangents.size() };
+	MeshCache::write(file, sourceSize, sourceTime, arrays);
 }
 
 void Model::readDiffuseMap(string file)
 {
-	diffuse_map.read_tga_file(file);
+	TGAImage img;
+	if (img.read_tga_file(file)) diffuse_map = Texture(img);
 }
 
 void Model::readNormalMap(string file)
 {
-	norm_map.read_tga_file(file);
+	TGAImage img;
+	if (img.read_tga_file(file)) {
+		norm_map = Texture(img, TextureWrap::Repeat, TexelFormat::Normal);
+		normalMapLoaded = true;
+	}
 }
 
 void Model::readSpecularMap(string file)
 {
-	specular_map.read_tga_file(file);
+	TGAImage img;
+	if (img.read_tga_file(file)) specular_map = Texture(img);
 }
 
-void Model::testPrint()
+void Model::testPrint() const
 {
 	cout << "# verts" << endl;
 	for each (auto v in verts)
@@ -95,11 +227,12 @@ void Model::testPrint()
 		cout << v.x << " " << v.y << " " << v.z << endl;
 	}
 	cout << "# facets" << endl;
-	for each (auto v in facets)
+	for (int f = 0; f < facetCount(); f++)
 	{
 		for (int i = 0; i < 3; i++)
 		{
-			cout << v.verts[i] << "/" << v.uv[i] << "/" << v.normals[i] << " ";
+			auto& v = uniqueVerts[uniqueVertIndex(f, i)];
+			cout << v.pos << "/" << v.uv << "/" << v.normal << " ";
 		}
 		cout << endl;
 	}
@@ -107,13 +240,14 @@ void Model::testPrint()
 
 Model::Model(string model_dir)
 {
+	string objFile;
 	for (auto &v : directory_iterator(model_dir))
 	{
 		auto ext = v.path().extension().string();
 		auto name = v.path().filename().string();
 		auto path = v.path().string();
 		if (ext == ".obj") {
-			readObjFile(path);
+			objFile = path;
 		}
 		else if (ext == ".tga") {
 			if (name.find("diffuse") != string::npos) {
@@ -127,57 +261,76 @@ Model::Model(string model_dir)
 			}
 		}
 	}
+	if (!objFile.empty()) loadMesh(objFile);
 }
 
-int Model::vertCount()
+int Model::vertCount() const
 {
 	return (int)verts.size();
 }
 
-int Model::facetCount()
+int Model::facetCount() const
 {
-	return (int)facets.size();
+	return (int)facetUniqueVerts.size() / 3;
 }
 
-Vector3 Model::vertPos(const int ifacet, const int ivert)
+Vector3 Model::vertPos(const int ifacet, const int ivert) const
 {
-	auto& i = facets[ifacet].verts[ivert];
-	if (i >= verts.size()) {
-		cout << "Error:vertOfFacet," + to_string(i) << endl;
-		return Vector3(0, 0, 0);
-	}
-	return verts[i];
+	return verts[uniqueVerts[uniqueVertIndex(ifacet, ivert)].pos];
+}
+
+Vector2 Model::vertUV(const int ifacet, const int ivert) const
+{
+	return uv[uniqueVerts[uniqueVertIndex(ifacet, ivert)].uv];
+}
+
+Vector3 Model::vertNormal(const int ifacet, const int ivert) const
+{
+	return normals[uniqueVerts[uniqueVertIndex(ifacet, ivert)].normal];
+}
+
+int Model::uniqueVertCount() const
+{
+	return (int)uniqueVerts.size();
 }
 
-Vector2 Model::vertUV(const int ifacet, const int ivert)
+int Model::uniqueVertIndex(const int ifacet, const int ivert) const
 {
-	return uv[facets[ifacet].uv[ivert]];
+	return facetUniqueVerts[ifacet * 3 + ivert];
 }
 
-Vector3 Model::vertNormal(const int ifacet, const int ivert)
+Vector3 Model::uniqueVertPos(const int i) const
 {
-	return normals[facets[ifacet].normals[ivert]];
+	return verts[uniqueVerts[i].pos];
 }
 
-Color32 Model::diffuseMap(const Vector2& uv)
+Vector2 Model::uniqueVertUV(const int i) const
 {
-	return getColorWithUV(diffuse_map, uv.x, uv.y);
+	return uv[uniqueVerts[i].uv];
 }
 
-static float color2normal(const uint8_t rgb) {
-	return 2 * rgb / 255.f - 1;
+Vector3 Model::uniqueVertNormal(const int i) const
+{
+	return normals[uniqueVerts[i].normal];
+}
+
+Vector4 Model::uniqueVertTangent(const int i) const
+{
+	return tangents[i];
 }
-Vector3 Model::normalMap(const Vector2& uv)
+
+Color32 Model::diffuseMap(const Vector2& uv, const TextureSampler& sampler) const
+{
+	return ToColor32(diffuse_map.sample(uv.x, uv.y, sampler));
+}
+
+Vector3 Model::normalMap(const Vector2& uv, const TextureSampler& sampler) const
 {
-	auto color = getColorWithUV(norm_map, uv.x, uv.y);
-	auto x = color2normal(color.r());
-	auto y = color2normal(color.g());
-	auto z = color2normal(color.b());
-	return Vector3(x,y,z);
+	return norm_map.sampleNormal(uv.x, uv.y, sampler);
 }
 
-float Model::specularMap(const Vector2& uv)
+float Model::specularMap(const Vector2& uv, const TextureSampler& sampler) const
 {
-	auto color = getColorWithUV(specular_map, uv.x, uv.y);
+	auto color = ToColor32(specular_map.sample(uv.x, uv.y, sampler));
 	return color.r();
 }
@@ -1,6 +1,9 @@
 #pragma once
 #include "mathUtil.h";
 #include "tgaimage.h"
+#include "Texture.h"
+#include "MeshCache.h"
+#include "ObjParser.h"
 #include <vector>
 #include <string>
 #include <iostream>
@@ -10,43 +13,79 @@
 
 using namespace std;
 
-struct Facet {
-	// 3objļеĶ
-	vector<int> verts{ 0,0,0 };
-	// 3objļеuv
-	vector<int> uv{ 0,0,0 };
-	// 3objļеķ
-	vector<int> normals{ 0,0,0 };
+// flat index buffer, 16 bit when every index fits, otherwise 32 bit
+class IndexBuffer {
+public:
+	ArrayView<uint16_t> index16;
+	ArrayView<uint32_t> index32;
+
+	int operator[](size_t i) const { return index16.empty() ? (int)index32[i] : (int)index16[i]; }
+	size_t size() const { return index16.empty() ? index32.size() : index16.size(); }
 };
 
+// immutable once loaded, renders share it through shared_ptr<const Model>
 class Model
 {
 public:
 	Model(string model_dir);
-	int vertCount();
-	int facetCount();
-	Vector3 vertPos(const int ifacet, const int ivert);
-	Vector2 vertUV(const int ifacet, const int ivert);
-	Vector3 vertNormal(const int ifacet, const int ivert);
-	Color32 diffuseMap(const Vector2& uv);
-	Vector3 normalMap(const Vector2& uv);
-	float specularMap(const Vector2& uv);
-	void testPrint();
-
-	vector<Facet> facets;
-	vector<Vector3> verts;
-	vector<Vector2> uv;
-	vector<Vector3> normals;
+	Model(const Model&) = delete;
+	Model& operator=(const Model&) = delete;
+	int vertCount() const;
+	int facetCount() const;
+	Vector3 vertPos(const int ifacet, const int ivert) const;
+	Vector2 vertUV(const int ifacet, const int ivert) const;
+	Vector3 vertNormal(const int ifacet, const int ivert) const;
+	int uniqueVertCount() const;
+	int uniqueVertIndex(const int ifacet, const int ivert) const;
+	Vector3 uniqueVertPos(const int i) const;
+	Vector2 uniqueVertUV(const int i) const;
+	Vector3 uniqueVertNormal(const int i) const;
+	Vector4 uniqueVertTangent(const int i) const;
+	Color32 diffuseMap(const Vector2& uv, const TextureSampler& sampler = TextureSampler()) const;
+	// unit length, decoded at load
+	Vector3 normalMap(const Vector2& uv, const TextureSampler& sampler = TextureSampler()) const;
+	float specularMap(const Vector2& uv, const TextureSampler& sampler = TextureSampler()) const;
+	// false when the model has no normal map, it then shades with the vertex normals
+	bool hasNormalMap() const { return normalMapLoaded; }
+	void testPrint() const;
+
+	// views of the mesh arrays, pointing into the mapped .cmesh cache or into the storage below
+	ArrayView<Vector3> verts;
+	ArrayView<Vector2> uv;
+	ArrayView<Vector3> normals;
+
+	// facet corners deduplicated by (position, uv, normal), so each is transformed once per frame
+	ArrayView<VertIndex> uniqueVerts;
+	IndexBuffer facetUniqueVerts; // 3 per facet, index into uniqueVerts
+	// per unique vert: unit tangent along +u, orthogonal to the normal; w is the bitangent sign, B = w * cross(N, T)
+	ArrayView<Vector4> tangents;
 
 private:
+	void loadMesh(string objFile);
+	bool readMeshCache(string file, uint64_t sourceSize, int64_t sourceTime);
+	void writeMeshCache(string file, uint64_t sourceSize, int64_t sourceTime);
 	void readObjFile(string file);
 	void readDiffuseMap(string file);
 	void readNormalMap(string file);
 	void readSpecularMap(string file);
+	void buildUniqueVerts();
+	void buildTangents();
+	bool validateMesh();
 
+	// mesh storage when parsed from the .obj, empty when the mesh is mapped from the cache
+	vector<VertIndex> corners; // 3 per facet, until the unique verts are built
+	vector<Vector3> vertData;
+	vector<Vector2> uvData;
+	vector<Vector3> normalData;
+	vector<VertIndex> uniqueVertData;
+	vector<uint16_t> facetIndex16Data;
+	vector<uint32_t> facetIndex32Data;
+	vector<Vector4> tangentData;
+	MeshCache meshCache;
 
-	TGAImage diffuse_map;
-	TGAImage norm_map;
-	TGAImage specular_map;
+	Texture diffuse_map;
+	Texture norm_map;
+	bool normalMapLoaded = false;
+	Texture specular_map;
 };
 
@@ -0,0 +1,264 @@
+#include "ObjParser.h"
+#include "MeshCache.h"
+#include "ThreadPool.hpp"
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+// chunks are at least this big, smaller files are parsed by one thread
+#define OBJ_MIN_CHUNK (256 * 1024)
+// marks a corner without uv or normal until the merge assigns a default
+#define OBJ_MISSING INT_MIN
+// faces whose edges at the first corner enclose an angle with a smaller sine are degenerate
+#define OBJ_DEGENERATE_SINE 1e-6f
+
+// parse result of one chunk, indices are relative to the chunk until the merge
+struct ObjChunk {
+	const char* begin;
+	const char* end;
+	vector<Vector3> verts;
+	vector<Vector2> uv;
+	vector<Vector3> normals;
+	vector<VertIndex> corners;
+	// corners whose pos / uv / normal came from a negative index, so they count from the chunk's first element
+	vector<int> relative[3];
+	int errors = 0;
+};
+
+// one corner of a face while it is read, bit k of relative is set if component k is a negative index
+struct ObjCorner {
+	VertIndex index;
+	int relative;
+};
+
+static bool isBlank(char c) {
+	return c == ' ' || c == '\t';
+}
+
+static const char* skipBlanks(const char* p, const char* end) {
+	while (p < end && isBlank(*p)) p++;
+	return p;
+}
+
+static const char* nextLine(const char* p, const char* end) {
+	auto eol = static_cast<const char*>(memchr(p, '\n', end - p));
+	return eol ? eol + 1 : end;
+}
+
+static bool parseFloat(const char*& p, const char* end, float& v) {
+	auto s = skipBlanks(p, end);
+	if (s < end && *s == '+') s++;
+	auto r = from_chars(s, end, v);
+	if (r.ec != errc()) return false;
+	p = r.ptr;
+	return true;
+}
+
+static bool parseInt(const char*& p, const char* end, int& v) {
+	auto s = skipBlanks(p, end);
+	if (s < end && *s == '+') s++;
+	auto r = from_chars(s, end, v);
+	if (r.ec != errc()) return false;
+	p = r.ptr;
+	return true;
+}
+
+// obj indices are 1-based, negative ones count back from the last element read so far
+static bool resolveIndex(int raw, size_t count, int& index, int& relative, int bit) {
+	if (raw > 0) {
+		index = raw - 1;
+		return true;
+	}
+	if (raw < 0) {
+		index = (int)count + raw;
+		relative |= bit;
+		return true;
+	}
+	return false;
+}
+
+// reads the corners of an "f" line, p points behind the "f"
+static bool parseFace(const char*& p, const char* end, ObjChunk& c, vector<ObjCorner>& poly) {
+	poly.clear();
+	while (true) {
+		p = skipBlanks(p, end);
+		if (p >= end || *p == '\n' || *p == '\r' || *p == '#') break;
+
+		ObjCorner corner{ { OBJ_MISSING, OBJ_MISSING, OBJ_MISSING }, 0 };
+		int raw;
+		if (!parseInt(p, end, raw) || !resolveIndex(raw, c.verts.size(), corner.index.pos, corner.relative, 1)) return false;
+		if (p < end && *p == '/') {
+			p++;
+			if (p < end && *p != '/') {
+				if (!parseInt(p, end, raw) || !resolveIndex(raw, c.uv.size(), corner.index.uv, corner.relative, 2)) return false;
+			}
+			if (p < end && *p == '/') {
+				p++;
+				if (!parseInt(p, end, raw) || !resolveIndex(raw, c.normals.size(), corner.index.normal, corner.relative, 4)) return false;
+			}
+		}
+		if (p < end && !isBlank(*p) && *p != '\n' && *p != '\r') return false;
+		poly.push_back(corner);
+	}
+	if (poly.size() < 3) return false;
+
+	// triangle fan around the first corner
+	for (size_t i = 1; i + 1 < poly.size(); i++) {
+		const ObjCorner* tri[3] = { &poly[0], &poly[i], &poly[i + 1] };
+		for (auto corner : tri) {
+			for (int k = 0; k < 3; k++) {
+				if (corner->relative & (1 << k)) c.relative[k].push_back((int)c.corners.size());
+			}
+			c.corners.push_back(corner->index);
+		}
+	}
+	return true;
+}
+
+static void parseChunk(ObjChunk& c) {
+	const char* p = c.begin;
+	const char* end = c.end;
+	vector<ObjCorner> poly;
+	while (p < end) {
+		p = skipBlanks(p, end);
+		bool ok = true;
+		if (end - p > 2 && p[0] == 'v' && isBlank(p[1])) {
+			p += 2;
+			Vector3 v;
+			ok = parseFloat(p, end, v.x) && parseFloat(p, end, v.y) && parseFloat(p, end, v.z);
+			if (ok) c.verts.push_back(v);
+		}
+		else if (end - p > 3 && p[0] == 'v' && p[1] == 't' && isBlank(p[2])) {
+			p += 3;
+			Vector2 v(0, 0);
+			ok = parseFloat(p, end, v.x);
+			parseFloat(p, end, v.y); // v is optional
+			if (ok) c.uv.push_back(v);
+		}
+		else if (end - p > 3 && p[0] == 'v' && p[1] == 'n' && isBlank(p[2])) {
+			p += 3;
+			Vector3 v;
+			ok = parseFloat(p, end, v.x) && parseFloat(p, end, v.y) && parseFloat(p, end, v.z);
+			if (ok) c.normals.push_back(v);
+		}
+		else if (end - p > 2 && p[0] == 'f' && isBlank(p[1])) {
+			p += 1;
+			ok = parseFace(p, end, c, poly);
+		}
+		if (!ok) c.errors++;
+		p = nextLine(p, end);
+	}
+}
+
+int parseObj(const char* text, size_t size, ObjMesh& mesh, int threadCount)
+{
+	ThreadPool pool(threadCount);
+
+	// split at line ends into a few chunks per thread
+	size_t chunkCount = max<size_t>(1, min(size / OBJ_MIN_CHUNK, (size_t)pool.size() * 4));
+	vector<ObjChunk> chunks(chunkCount);
+	const char* end = text + size;
+	const char* p = text;
+	for (size_t i = 0; i < chunkCount; i++) {
+		chunks[i].begin = p;
+		const char* target = max(p, text + size * (i + 1) / chunkCount);
+		p = i + 1 == chunkCount || target >= end ? end : nextLine(target, end);
+		chunks[i].end = p;
+	}
+
+	pool.ParallelFor((int)chunkCount, [&](int i, int) { parseChunk(chunks[i]); });
+
+	// merge in file order
+	size_t vertCount = 0, uvCount = 0, normalCount = 0, cornerCount = 0;
+	for (auto& c : chunks) {
+		vertCount += c.verts.size();
+		uvCount += c.uv.size();
+		normalCount += c.normals.size();
+		cornerCount += c.corners.size();
+	}
+	mesh.verts.clear();
+	mesh.uv.clear();
+	mesh.normals.clear();
+	mesh.corners.clear();
+	mesh.verts.reserve(vertCount);
+	mesh.uv.reserve(uvCount + 1);
+	mesh.normals.reserve(normalCount);
+	mesh.corners.reserve(cornerCount);
+
+	int errors = 0;
+	bool missingUV = false, missingNormal = false;
+	for (auto& c : chunks) {
+		int base[3] = { (int)mesh.verts.size(), (int)mesh.uv.size(), (int)mesh.normals.size() };
+		for (auto i : c.relative[0]) c.corners[i].pos += base[0];
+		for (auto i : c.relative[1]) c.corners[i].uv += base[1];
+		for (auto i : c.relative[2]) c.corners[i].normal += base[2];
+
+		mesh.verts.insert(mesh.verts.end(), c.verts.begin(), c.verts.end());
+		mesh.uv.insert(mesh.uv.end(), c.uv.begin(), c.uv.end());
+		mesh.normals.insert(mesh.normals.end(), c.normals.begin(), c.normals.end());
+		errors += c.errors;
+		vector<Vector3>().swap(c.verts);
+		vector<Vector2>().swap(c.uv);
+		vector<Vector3>().swap(c.normals);
+	}
+
+	// drop triangles with bad positions, bad uvs and normals fall back to the defaults
+	for (auto& c : chunks) {
+		for (size_t i = 0; i < c.corners.size(); i += 3) {
+			auto tri = &c.corners[i];
+			bool valid = true;
+			for (int j = 0; j < 3; j++) {
+				auto& v = tri[j];
+				if (v.pos < 0 || v.pos >= (int)vertCount) valid = false;
+				if (v.uv < 0 || v.uv >= (int)uvCount) v.uv = OBJ_MISSING;
+				if (v.normal < 0 || v.normal >= (int)normalCount) v.normal = OBJ_MISSING;
+				missingUV |= v.uv == OBJ_MISSING;
+				missingNormal |= v.normal == OBJ_MISSING;
+			}
+			if (valid) mesh.corners.insert(mesh.corners.end(), tri, tri + 3);
+			else errors++;
+		}
+		vector<VertIndex>().swap(c.corners);
+	}
+
+	if (missingUV) {
+		int defaultUV = (int)mesh.uv.size();
+		mesh.uv.push_back(Vector2(0, 0));
+		for (auto& v : mesh.corners) {
+			if (v.uv == OBJ_MISSING) v.uv = defaultUV;
+		}
+	}
+	if (missingNormal) {
+		for (size_t i = 0; i < mesh.corners.size(); i += 3) {
+			auto tri = &mesh.corners[i];
+			if (tri[0].normal != OBJ_MISSING && tri[1].normal != OBJ_MISSING && tri[2].normal != OBJ_MISSING) continue;
+			auto& a = mesh.verts[tri[0].pos];
+			auto& b = mesh.verts[tri[1].pos];
+			auto& c = mesh.verts[tri[2].pos];
+			// collinear or repeated positions have no normal of their own, they face +z
+			auto ab = b - a, ac = c - a;
+			auto n = Vector3::Cross(ab, ac);
+			float len = n.Magnitude();
+			int faceNormal = (int)mesh.normals.size();
+			mesh.normals.push_back(len > OBJ_DEGENERATE_SINE * ab.Magnitude() * ac.Magnitude() ? n / len : Vector3::Forward());
+			for (int j = 0; j < 3; j++) {
+				if (tri[j].normal == OBJ_MISSING) tri[j].normal = faceNormal;
+			}
+		}
+	}
+	return errors;
+}
+
+bool readObj(const string& file, ObjMesh& mesh, int threadCount)
+{
+	MappedFile in;
+	if (!in.open(file)) {
+		cerr << "can't open file " << file << "\n";
+		return false;
+	}
+	int errors = parseObj(reinterpret_cast<const char*>(in.data()), in.size(), mesh, threadCount);
+	if (errors) cerr << file << ": skipped " << errors << " malformed lines or faces\n";
+	return true;
+}
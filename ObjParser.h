@@ -0,0 +1,33 @@
+#pragma once
+#include "MathUtil.h"
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// one distinct (position, uv, normal) combination used by the facets
+struct VertIndex {
+	int pos;
+	int uv;
+	int normal;
+
+	bool operator==(const VertIndex& o) const { return pos == o.pos && uv == o.uv && normal == o.normal; }
+};
+
+// triangle mesh as read from an .obj, indices are 0-based
+struct ObjMesh {
+	vector<Vector3> verts;
+	vector<Vector2> uv;
+	vector<Vector3> normals;
+	vector<VertIndex> corners; // 3 per triangle
+};
+
+// Parses .obj text. The text is split at line boundaries into chunks that are parsed in parallel and
+// merged in file order. Faces may be triangles, quads or n-gons (triangulated as fans) in any of the
+// forms v, v/vt, v//vn and v/vt/vn, with positive or negative (relative) indices. Corners without a
+// uv get uv (0, 0), triangles without normals get their face normal.
+// threadCount <= 0 uses every hardware thread. Returns the number of malformed lines and faces that were skipped.
+int parseObj(const char* text, size_t size, ObjMesh& mesh, int threadCount = 0);
+
+// maps the file and parses it, false if it can't be opened
+bool readObj(const string& file, ObjMesh& mesh, int threadCount = 0);
@@ -0,0 +1,213 @@
+#include "GLUtil.hpp"
+#include <cstdint>
+
+#pragma once
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define RASTER_SIMD 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define RASTER_SIMD 0
+#endif
+
+// MSVC lets any function use the intrinsics, gcc/clang need them enabled per function
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// raster blocks are 4x2 pixels; lane i is pixel (i % 4, i / 4) of the block
+#define BLOCK_WIDTH 4
+#define BLOCK_HEIGHT 2
+#define BLOCK_LANES 8
+// the block kernels return the lanes that pass the depth test in the low BLOCK_LANES bits
+// and the lanes the triangle covers in the BLOCK_LANES bits above them
+#define BLOCK_PASS_MASK ((1 << BLOCK_LANES) - 1)
+
+// 4x multisampling: depth and coverage at four rotated grid positions per pixel, in subpixels from the
+// pixel's sample point (the D3D standard pattern)
+#define MSAA_SAMPLES 4
+const int MsaaOffsets[MSAA_SAMPLES][2] = { { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 } };
+#define MSAA_REACH 6 // largest offset in x or y
+
+// instruction set used for the per-block coverage / depth kernel
+enum class RasterSimd { Auto, Scalar, SSE41, AVX2 };
+
+// per-triangle raster constants, computed once before binning
+class TriangleSetup {
+public :
+    EdgeFunction edges[3]; // edges[i] is opposite to verts[i], its value is the unnormalized barycentric weight of verts[i]
+    float invArea;
+    int xmin, xmax, ymin, ymax; // pixels whose sample point lies in the triangle's bounding box
+
+    // vertex homogeneous w and ndc depth, read by the vector kernels
+    float w[3];
+    float z[3];
+};
+
+// number of set lanes in a block mask
+int LaneCount(int mask) {
+    mask = mask - ((mask >> 1) & 0x55);
+    mask = (mask & 0x33) + ((mask >> 2) & 0x33);
+    return (mask + (mask >> 4)) & 0x0F;
+}
+
+RasterSimd DetectRasterSimd() {
+    static RasterSimd detected = [] {
+#if RASTER_SIMD
+        bool sse41 = false, avx2 = false;
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        int maxLeaf = info[0];
+        __cpuid(info, 1);
+        sse41 = (info[2] & (1 << 19)) != 0;
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6) {
+            __cpuidex(info, 7, 0);
+            avx2 = (info[1] & (1 << 5)) != 0;
+        }
+#else
+        __builtin_cpu_init();
+        sse41 = __builtin_cpu_supports("sse4.1");
+        avx2 = __builtin_cpu_supports("avx2");
+#endif
+        if (avx2) return RasterSimd::AVX2;
+        if (sse41) return RasterSimd::SSE41;
+#endif
+        return RasterSimd::Scalar;
+    }();
+    return detected;
+}
+
+// the requested kernel, lowered to what the cpu supports
+RasterSimd ResolveRasterSimd(RasterSimd requested) {
+    auto detected = DetectRasterSimd();
+    if (requested == RasterSimd::Auto) return detected;
+    return (int)requested < (int)detected ? requested : detected;
+}
+
+#if RASTER_SIMD
+
+// Vector versions of the scalar block kernel (see RasterBlockScalar): same operations in the same order,
+// so results are bit-identical. w[] are the edge values at the block's first pixel, zRow0/zRow1 point at
+// the depth of the block's two rows. Returns the mask of lanes that are covered and pass the depth test,
+// with the covered lanes above it (see BLOCK_PASS_MASK); the passing lanes' depth is written and their
+// perspective-correct barycentrics are stored in barCoo.
+
+TARGET_AVX2 int RasterBlockAVX2(const TriangleSetup& setup, const int64_t w[3], int laneMask,
+    float* zRow0, float* zRow1, float barCoo[3][BLOCK_LANES]) {
+    // edge values of the 8 lanes stay exact in double (|E| < 2^53)
+    __m256d e0[3], e1[3];
+    __m256d signs0 = _mm256_setzero_pd(), signs1 = _mm256_setzero_pd();
+    for (int i = 0; i < 3; i++) {
+        auto& edge = setup.edges[i];
+        double sx = (double)edge.StepX();
+        double sy = (double)edge.StepY();
+        __m256d lane = _mm256_set_pd(3 * sx, 2 * sx, sx, 0);
+        __m256d base = _mm256_set1_pd((double)w[i]);
+        e0[i] = _mm256_add_pd(base, lane);
+        e1[i] = _mm256_add_pd(_mm256_add_pd(base, _mm256_set1_pd(sy)), lane);
+        __m256d bias = _mm256_set1_pd((double)edge.bias);
+        signs0 = _mm256_or_pd(signs0, _mm256_add_pd(e0[i], bias));
+        signs1 = _mm256_or_pd(signs1, _mm256_add_pd(e1[i], bias));
+    }
+    int covered = (~(_mm256_movemask_pd(signs0) | (_mm256_movemask_pd(signs1) << 4))) & laneMask;
+    if (!covered) return 0;
+
+    // screen space barycentrics -> perspective correct barycentrics
+    __m256 invArea = _mm256_set1_ps(setup.invArea);
+    __m256 r[3];
+    for (int i = 0; i < 3; i++) {
+        __m256 s = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(e0[i])), _mm256_cvtpd_ps(e1[i]), 1);
+        s = _mm256_mul_ps(s, invArea);
+        r[i] = _mm256_div_ps(s, _mm256_set1_ps(setup.w[i]));
+    }
+    __m256 sum = _mm256_add_ps(_mm256_add_ps(r[0], r[1]), r[2]);
+    __m256 bar[3];
+    for (int i = 0; i < 3; i++) {
+        bar[i] = _mm256_div_ps(r[i], sum);
+        _mm256_storeu_ps(barCoo[i], bar[i]);
+    }
+
+    // depth test, the comparison is !(zBuffer >= depth) like TestFrag
+    __m256 depth = _mm256_add_ps(_mm256_add_ps(
+        _mm256_mul_ps(bar[0], _mm256_set1_ps(setup.z[0])),
+        _mm256_mul_ps(bar[1], _mm256_set1_ps(setup.z[1]))),
+        _mm256_mul_ps(bar[2], _mm256_set1_ps(setup.z[2])));
+    __m256 zOld = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(zRow0)), _mm_loadu_ps(zRow1), 1);
+    int pass = _mm256_movemask_ps(_mm256_cmp_ps(zOld, depth, _CMP_NGE_UQ)) & covered;
+    if (!pass) return covered << BLOCK_LANES;
+
+    // masked store of the new depth
+    __m256i bits = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+    __m256i store = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(pass), bits), bits);
+    _mm_maskstore_ps(zRow0, _mm256_castsi256_si128(store), _mm256_castps256_ps128(depth));
+    _mm_maskstore_ps(zRow1, _mm256_extracti128_si256(store, 1), _mm256_extractf128_ps(depth, 1));
+    return pass | covered << BLOCK_LANES;
+}
+
+TARGET_SSE41 int RasterBlockSSE41(const TriangleSetup& setup, const int64_t w[3], int laneMask,
+    float* zRow0, float* zRow1, float barCoo[3][BLOCK_LANES]) {
+    __m128 s[2][3];
+    __m128d signs[4] = { _mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd(), _mm_setzero_pd() };
+    for (int i = 0; i < 3; i++) {
+        auto& edge = setup.edges[i];
+        double sx = (double)edge.StepX();
+        double sy = (double)edge.StepY();
+        __m128d laneLo = _mm_set_pd(sx, 0);
+        __m128d laneHi = _mm_set_pd(3 * sx, 2 * sx);
+        __m128d bias = _mm_set1_pd((double)edge.bias);
+        for (int row = 0; row < 2; row++) {
+            __m128d base = _mm_set1_pd((double)w[i] + row * sy);
+            __m128d lo = _mm_add_pd(base, laneLo);
+            __m128d hi = _mm_add_pd(base, laneHi);
+            signs[row * 2] = _mm_or_pd(signs[row * 2], _mm_add_pd(lo, bias));
+            signs[row * 2 + 1] = _mm_or_pd(signs[row * 2 + 1], _mm_add_pd(hi, bias));
+            s[row][i] = _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi));
+        }
+    }
+    int outside = _mm_movemask_pd(signs[0]) | (_mm_movemask_pd(signs[1]) << 2)
+        | (_mm_movemask_pd(signs[2]) << 4) | (_mm_movemask_pd(signs[3]) << 6);
+    int covered = ~outside & laneMask;
+    if (!covered) return 0;
+
+    __m128 invArea = _mm_set1_ps(setup.invArea);
+    int pass = 0;
+    float* zRows[2] = { zRow0, zRow1 };
+    for (int row = 0; row < 2; row++) {
+        __m128 r[3];
+        for (int i = 0; i < 3; i++) {
+            r[i] = _mm_div_ps(_mm_mul_ps(s[row][i], invArea), _mm_set1_ps(setup.w[i]));
+        }
+        __m128 sum = _mm_add_ps(_mm_add_ps(r[0], r[1]), r[2]);
+        __m128 bar[3];
+        for (int i = 0; i < 3; i++) {
+            bar[i] = _mm_div_ps(r[i], sum);
+            _mm_storeu_ps(barCoo[i] + row * BLOCK_WIDTH, bar[i]);
+        }
+        __m128 depth = _mm_add_ps(_mm_add_ps(
+            _mm_mul_ps(bar[0], _mm_set1_ps(setup.z[0])),
+            _mm_mul_ps(bar[1], _mm_set1_ps(setup.z[1]))),
+            _mm_mul_ps(bar[2], _mm_set1_ps(setup.z[2])));
+        __m128 zOld = _mm_loadu_ps(zRows[row]);
+        __m128 test = _mm_cmpnge_ps(zOld, depth);
+        int rowPass = _mm_movemask_ps(test) & (covered >> (row * BLOCK_WIDTH)) & 0xF;
+        if (!rowPass) continue;
+
+        __m128i bits = _mm_set_epi32(8, 4, 2, 1);
+        __m128i store = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(rowPass), bits), bits);
+        _mm_storeu_ps(zRows[row], _mm_blendv_ps(zOld, depth, _mm_castsi128_ps(store)));
+        pass |= rowPass << (row * BLOCK_WIDTH);
+    }
+    return pass | covered << BLOCK_LANES;
+}
+
+#endif
@@ -1,15 +1,40 @@
 #include "MathUtil.h"
 #include "GLUtil.hpp"
 #include "Model.h"
+#include "RenderTarget.h"
+#include "Heatmap.h"
+#include "RasterKernel.hpp"
+#include "Scene.hpp"
+#include "ThreadPool.hpp"
 #include "math.h"
+#include <memory>
+#include <map>
+#include <set>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <string>
 
 #pragma once
 
+class ShaderVariant;
+class ShaderRegistry;
+
+// per-triangle and per-fragment counters of RenderStats; build with RENDER_STATS 0 to compile them out,
+// the counts then read 0 and only the stage times are measured
+#ifndef RENDER_STATS
+#define RENDER_STATS 1
+#endif
+#if RENDER_STATS
+#define COUNT_STAT(x) x
+#else
+#define COUNT_STAT(x)
+#endif
 
 // 
 class Data {
 public:
-    Data(Model& model):model(model){}
+    Data(shared_ptr<const Model> model):model(model){}
 
     Vector2Int resolution;
 
@@ -39,154 +64,1153 @@ public:
     Color32 lightColor;
 
     // model, map
-    Model model;
+    shared_ptr<const Model> model; // shared by every view of the model, never copied
 
     // shader data
     Color32 ambient;
     float diffuseK = 1;
     float specularK = 1;
     float specularBasePower = 1;
+    TextureFilter textureFilter = TextureFilter::Nearest; // filter for the diffuse, normal and specular maps
+    int maxAnisotropy = 1;                                // trilinear only, > 1 enables anisotropic filtering
     bool isTangentSpaceNormalMap = true; // Ƿ߿ռ䷨ͼ
+    ShaderRegistry* shaders = nullptr;   // variants picked by material flags, nullptr uses BuiltinShaders()
+
+    // output: fragments are shaded in float, the frame is stored as targetFormat and resolved to 8 bit once
+    PixelFormat targetFormat = PixelFormat::RGBA32F;
+    Tonemap tonemap = Tonemap::Clamp;
+    float exposure = 1;
 
     Vector3 camViewPos() { return Vector3::Zero(); }
 
+    // parallel rasterization
+    int threadCount = 0; // worker threads, <= 0 uses every hardware thread
+    int tileSize = 64;   // edge of a screen tile in pixels, <= 0 rasterizes the whole frame as one tile
+    RasterSimd simd = RasterSimd::Auto; // block kernel, lowered to what the cpu supports; Scalar is the reference path
+    bool visibilityBuffer = false;      // rasterize depth, triangle id and barycentrics first, then shade each visible pixel once;
+                                        // not combined with msaa, which always shades as it rasterizes
+    int msaa = 1;                       // 4 for 4x multisampling: coverage and depth per sample, shading once per pixel and
+                                        // triangle; other values take one sample per pixel
+    bool hierarchicalZ = true;          // reject occluded triangles and 8x8 cells before the per-pixel depth test
+    bool cullInstances = true;          // scenes: skip the instances whose bounds are outside the view frustum
+    Vector2Int scissorMin = Vector2Int(0, 0); // pixels [scissorMin, scissorMax) are drawn, clamped to the viewport;
+    Vector2Int scissorMax = Vector2Int(0, 0); // an empty rect draws the whole viewport
+
     // temp
     Matrix4x4 modelMat;
     Matrix4x4 viewMat;
     Matrix4x4 projMat;
     Matrix4x4 mvp;
+    Matrix4x4 mvMat;
     Matrix4x4 viewportMat;
     Matrix4x4 normalTranslateMat;
+    Affine3x4 modelAffine;  // modelMat, mvMat and normalTranslateMat without their constant bottom row,
+    Affine3x4 mvAffine;     // for the batch transforms of the vertex stage
+    Affine3x4 normalAffine;
+    float tangentHandedness; // -1 when mvMat mirrors, which flips cross(N, T) against the model's tangent frames
     Vector3 lightNdcPos;
     Vector3 lightViewPos;
     Vector3 camNdcPos;
     int length;
+    RasterSimd rasterSimd;
+    int samples; // per pixel, 1 or MSAA_SAMPLES
+    int drawX0, drawY0, drawX1, drawY1; // the scissor rect inside the viewport, every bounding box is clamped to it
+    float guardBandX, guardBandY;       // in ndc, triangles are only clipped in x and y beyond these
+    const ShaderVariant* shader; // of the material, see SelectShader
+};
+
+// vertex attributes a shader reads. Only the declared ones are transformed, assembled into triangles and
+// interpolated for its fragments; the position is always transformed.
+enum Varying {
+    VaryingUV = 1 << 0,
+    VaryingViewPos = 1 << 1,
+    VaryingWorldPos = 1 << 2,
+    VaryingNormal = 1 << 3,
+    VaryingTangent = 1 << 4,
+    VaryingAll = (1 << 5) - 1,
 };
 
+constexpr bool HasVarying(int varyings, int varying) { return (varyings & varying) != 0; }
+
+// clip planes, see ClipDistance: triangles outside one of the view frustum's are culled,
+// the ones crossing near, far or the guard band are clipped
+#define CLIP_PLANES 10
+#define CLIP_FRUSTUM 0x3F
+#define CLIP_CLIPPED 0x3F0
+#define CLIP_MAX_VERTS 9 // 3 + one per clipped plane
+
 // 
 class Vertex {
 public :
     int ifacet, ivert;
     Vector2 uv;
+    Vector4 clipPos;
     Vector3 ndcPos;
     Vector3 worldPos;
     Vector3 viewPos;
     Vector3 normal; // world
+    Vector3 tangent; // view, along +u of the normal map
     Vector4 homScreenPos; // Ļ
     Vector2 screenPos;
 
 };
 
 // Ƭ
+class Triangle;
 class Frag {
 public :
+    Triangle* tri;
     Vertex* verts; // 3 vertex of triangle
     Vector2Int screenPos;
     Vector3 barCoo;
+    Vector2 uvDx, uvDy; // uv derivatives of the frag's 2x2 quad, only set for trilinear filtering
+
+    // varyings at barCoo, only the ones the shader declared are interpolated
     Vector2 uv;
+    Vector3 viewPos;
+    Vector3 worldPos;
+    Vector3 normal;
+    Vector3 tangent;
+};
+
+// heap memory a vector holds on to
+template <class T> size_t VectorBytes(const vector<T>& v) { return v.capacity() * sizeof(T); }
+
+// post-transform vertices in structure-of-arrays layout, indexed like Model::uniqueVerts
+class VertexBuffer {
+public :
+    vector<Vector2> uv;
+    vector<Vector4> clipPos;
+    vector<uint16_t> clipCodes; // planes the vertex is outside of, a bit per ClipDistance plane
+    vector<Vector3> ndcPos;
+    vector<Vector3> worldPos;
+    vector<Vector3> viewPos;
+    vector<Vector3> normal;
+    vector<Vector3> tangent;
+    vector<Vector4> homScreenPos;
+    vector<Vector2> screenPos;
+
+    // the arrays of undeclared varyings stay empty
+    void resize(int n, int varyings = VaryingAll) {
+        clipPos.resize(n);
+        clipCodes.resize(n);
+        ndcPos.resize(n);
+        homScreenPos.resize(n);
+        screenPos.resize(n);
+        if (HasVarying(varyings, VaryingUV)) uv.resize(n);
+        if (HasVarying(varyings, VaryingWorldPos)) worldPos.resize(n);
+        if (HasVarying(varyings, VaryingViewPos)) viewPos.resize(n);
+        if (HasVarying(varyings, VaryingNormal)) normal.resize(n);
+        if (HasVarying(varyings, VaryingTangent)) tangent.resize(n);
+    }
+
+    size_t bytes() const {
+        return VectorBytes(uv) + VectorBytes(clipPos) + VectorBytes(clipCodes) + VectorBytes(ndcPos) + VectorBytes(worldPos)
+            + VectorBytes(viewPos) + VectorBytes(normal) + VectorBytes(tangent) + VectorBytes(homScreenPos) + VectorBytes(screenPos);
+    }
+};
+
+// model-space attributes VertexShader gathers before transforming them, for at most as many vertices as it was sized to
+class VertexGather {
+public :
+    vector<Vector3> pos;
+    vector<Vector3> normal;
+    vector<Vector3> tangent;
+
+    void resize(int n) {
+        pos.resize(n);
+        normal.resize(n);
+        tangent.resize(n);
+    }
+
+    size_t bytes() const { return VectorBytes(pos) + VectorBytes(normal) + VectorBytes(tangent); }
+};
+
+// cell size of RenderStats::tileFragmentMap
+#define HEATMAP_TILE 16
+
+// raw counts of one geometry chunk or one worker's tiles, summed into RenderStats after the frame.
+// Each worker has its own, so the stages count without atomics.
+class RenderCounters {
+public :
+    int64_t frustumCulled = 0;
+    int64_t clipped = 0;
+    int64_t backfacing = 0;
+    int64_t dropped = 0;
+    int64_t occluded = 0;
+    int64_t fragmentsTested = 0;
+    int64_t fragmentsPassed = 0;
+    int64_t fragmentsShaded = 0;
+    int64_t pixelsCovered = 0;
+    double shadeMs = 0;
+
+    void Add(const RenderCounters& c) {
+        frustumCulled += c.frustumCulled;
+        clipped += c.clipped;
+        backfacing += c.backfacing;
+        dropped += c.dropped;
+        occluded += c.occluded;
+        fragmentsTested += c.fragmentsTested;
+        fragmentsPassed += c.fragmentsPassed;
+        fragmentsShaded += c.fragmentsShaded;
+        pixelsCovered += c.pixelsCovered;
+        shadeMs += c.shadeMs;
+    }
+};
+
+// counters filled in by Render when it is given a stats object
+class RenderStats {
+public :
+    // wall time of each stage of RenderFrame, in ms
+    double setupMs = 0;    // frame target and matrices, and for a scene the instance culling
+    double vertexMs = 0;
+    double geometryMs = 0; // assembly, clipping, culling and triangle setup
+    double binMs = 0;
+    double rasterMs = 0;   // tiles: coverage, depth test and fragment shading
+    double resolveMs = 0;
+    double totalMs = 0;
+    double shadeMs = 0;    // visibility buffer mode: the shading pass summed over workers, part of rasterMs
+
+    int instancesIn = 0;     // scene instances, 1 for a single model
+    int instancesCulled = 0; // instances outside the view frustum, never transformed
+
+    int verticesIn = 0;     // facet corners
+    int verticesShaded = 0; // VertexShader invocations
+
+    int trianglesIn = 0;          // facets
+    int64_t frustumCulled = 0;    // facets outside one plane of the view frustum
+    int64_t clipped = 0;          // facets cut by a clip plane, each one drawn as a fan
+    int64_t backfacing = 0;       // triangles IsBackward rejects, fan triangles counted one by one
+    int64_t dropped = 0;          // triangles SetupTriangle rejects: zero area, out of range or outside the scissor rect
+    int trianglesRasterized = 0;  // triangles that reach binning
+    int64_t tilesOccluded = 0;    // triangle / tile pairs the hi-z rejects before any block is tested
+
+    int64_t fragmentsTested = 0;  // covered pixels that reach the depth test
+    int64_t depthRejected = 0;
+    int64_t fragmentsShaded = 0;
+    int64_t pixelsCovered = 0;    // pixels of the frame some triangle was drawn to
+
+    size_t scratchBytes = 0; // vertex buffers, triangles, tiles, tile buffers and the frame's render target
+
+    // diagnostic maps, made when heatmaps is set before the frame (and RENDER_STATS is on). They have the
+    // frame's size and go from black up to red at the largest value, which is kept next to each.
+    bool heatmaps = false;
+    TGAImage depthComplexityMap; // depth tests per pixel
+    TGAImage tileFragmentMap;    // depth tests per HEATMAP_TILE square
+    TGAImage tileTimeMap;        // ns per render tile; a Data::tileSize of HEATMAP_TILE gives the same grid
+    int maxDepthTests = 0;
+    int64_t maxTileFragments = 0;
+    double maxTileNs = 0;
+
+    // share of facet corners served from the post-transform vertex buffer
+    float vertexCacheHitRatio() const { return verticesIn ? 1 - (float)verticesShaded / verticesIn : 0; }
+    // fragment shader invocations per covered pixel, 1 when nothing is shaded twice
+    float overdrawRatio() const { return pixelsCovered ? (float)fragmentsShaded / pixelsCovered : 0; }
+    // depth tests per covered pixel
+    float depthComplexity() const { return pixelsCovered ? (float)fragmentsTested / pixelsCovered : 0; }
+
+    string ToJson() const {
+        string json = "{";
+        auto field = [&](const char* name, double value) {
+            char buf[96];
+            snprintf(buf, sizeof(buf), "%s\n  \"%s\": %.9g", json.size() > 1 ? "," : "", name, value);
+            json += buf;
+        };
+        field("setup_ms", setupMs);
+        field("vertex_ms", vertexMs);
+        field("geometry_ms", geometryMs);
+        field("bin_ms", binMs);
+        field("raster_ms", rasterMs);
+        field("resolve_ms", resolveMs);
+        field("total_ms", totalMs);
+        field("shade_ms", shadeMs);
+        field("instances_in", instancesIn);
+        field("instances_culled", instancesCulled);
+        field("vertices_in", verticesIn);
+        field("vertices_shaded", verticesShaded);
+        field("vertex_cache_hit_ratio", vertexCacheHitRatio());
+        field("triangles_in", trianglesIn);
+        field("frustum_culled", (double)frustumCulled);
+        field("clipped", (double)clipped);
+        field("backfacing", (double)backfacing);
+        field("dropped", (double)dropped);
+        field("triangles_rasterized", trianglesRasterized);
+        field("tiles_occluded", (double)tilesOccluded);
+        field("fragments_tested", (double)fragmentsTested);
+        field("depth_rejected", (double)depthRejected);
+        field("fragments_shaded", (double)fragmentsShaded);
+        field("pixels_covered", (double)pixelsCovered);
+        field("overdraw_ratio", overdrawRatio());
+        field("depth_complexity", depthComplexity());
+        field("scratch_bytes", (double)scratchBytes);
+        if (heatmaps) {
+            field("max_depth_tests", maxDepthTests);
+            field("max_tile_fragments", (double)maxTileFragments);
+            field("max_tile_ns", maxTileNs);
+        }
+        return json + "\n}\n";
+    }
+
+    bool WriteJson(const char* filename) const {
+        FILE* file = fopen(filename, "wb");
+        if (!file) {
+            cerr << "can't open file " << filename << "\n";
+            return false;
+        }
+        auto json = ToJson();
+        bool ok = fwrite(json.data(), 1, json.size(), file) == json.size();
+        fclose(file);
+        return ok;
+    }
+
+    // the maps as prefix_depth_complexity.tga, prefix_tile_fragments.tga and prefix_tile_time.tga
+    bool WriteHeatmaps(const string& prefix) const {
+        return depthComplexityMap.write_tga_file(prefix + "_depth_complexity.tga")
+            && tileFragmentMap.write_tga_file(prefix + "_tile_fragments.tga")
+            && tileTimeMap.write_tga_file(prefix + "_tile_time.tga");
+    }
+};
+
+// post-transform triangle, ready for binning and rasterization.
+// setup holds the raster constants; the shading constants below are also computed once, in the geometry stage.
+class Triangle {
+public :
+    Vertex verts[3];
+    TriangleSetup setup;
+    float bitangentSign; // handedness of the tangent frame, B = bitangentSign * cross(N, T)
+    int draw;            // index of the Data it is shaded with among the frame's draws, see RenderFrame
+};
+
+// screen tile: pixel rect [x0, x1) x [y0, y1) and the triangles touching it, in submission order
+class Tile {
+public :
+    int x0, y0, x1, y1;
+    vector<int> triangles;
+};
+
+// hierarchical z over a TileBuffer's depth: min/max per 8x8 cell, and min per 4x4 cells above that.
+// Depth only grows, so writes just raise the max and mark the cell dirty; a dirty min is a stale lower
+// bound that is recomputed the first time it fails to reject something.
+#define HIZ_CELL 8
+#define HIZ_COARSE 4
+
+class HiZBuffer {
+public :
+    HiZBuffer(int stride, int rows) : stride(stride), rows(rows),
+        width((stride + HIZ_CELL - 1) / HIZ_CELL), height((rows + HIZ_CELL - 1) / HIZ_CELL),
+        coarseWidth((width + HIZ_COARSE - 1) / HIZ_COARSE), coarseHeight((height + HIZ_COARSE - 1) / HIZ_COARSE),
+        cellMin(width * height), cellMax(width * height), dirty(width * height), coarseMin(coarseWidth * coarseHeight) {}
+
+    int stride, rows;                // size of the depth buffer
+    int width, height;               // in cells
+    int coarseWidth, coarseHeight;   // in coarse cells
+    vector<float> cellMin, cellMax;
+    vector<uint8_t> dirty;
+    vector<float> coarseMin;
+
+    void Clear() {
+        fill(cellMin.begin(), cellMin.end(), -FLT_MAX);
+        fill(cellMax.begin(), cellMax.end(), -FLT_MAX);
+        fill(dirty.begin(), dirty.end(), 0);
+        fill(coarseMin.begin(), coarseMin.end(), -FLT_MAX);
+    }
+
+    // x, y relative to the depth buffer origin
+    int cell(int x, int y) { return x / HIZ_CELL + y / HIZ_CELL * width; }
+
+    // true if nothing closer than maxDepth can pass the depth test anywhere in the pixel rect
+    bool Occluded(int x0, int y0, int x1, int y1, float maxDepth) {
+        int step = HIZ_CELL * HIZ_COARSE;
+        for (int y = y0 / step; y <= y1 / step; y++) {
+            for (int x = x0 / step; x <= x1 / step; x++) {
+                if (!(maxDepth <= coarseMin[x + y * coarseWidth])) return false;
+            }
+        }
+        return true;
+    }
+
+    bool CellOccluded(int cell, float maxDepth, vector<float>& zBuffer) {
+        if (maxDepth <= cellMin[cell]) return true;
+        if (!dirty[cell]) return false;
+        Refresh(cell, zBuffer);
+        return maxDepth <= cellMin[cell];
+    }
+
+    // the cell was completely overwritten with depths in [minDepth, maxDepth]
+    void Overwrite(int cell, float minDepth, float maxDepth) {
+        cellMin[cell] = minDepth;
+        cellMax[cell] = maxDepth;
+        dirty[cell] = 0;
+        RefreshCoarse(cell);
+    }
+
+    // some pixels of the cell were written with depths <= maxDepth
+    void Update(int cell, float maxDepth) {
+        cellMax[cell] = max(cellMax[cell], maxDepth);
+        dirty[cell] = 1;
+    }
+
+private :
+    void Refresh(int cell, vector<float>& zBuffer) {
+        int x0 = cell % width * HIZ_CELL, y0 = cell / width * HIZ_CELL;
+        int x1 = min(x0 + HIZ_CELL, stride), y1 = min(y0 + HIZ_CELL, rows);
+        float zmin = FLT_MAX;
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) zmin = min(zmin, zBuffer[x + y * stride]);
+        }
+        cellMin[cell] = zmin;
+        dirty[cell] = 0;
+        RefreshCoarse(cell);
+    }
+
+    void RefreshCoarse(int cell) {
+        int cx = cell % width / HIZ_COARSE, cy = cell / width / HIZ_COARSE;
+        int x1 = min((cx + 1) * HIZ_COARSE, width), y1 = min((cy + 1) * HIZ_COARSE, height);
+        float zmin = FLT_MAX;
+        for (int y = cy * HIZ_COARSE; y < y1; y++) {
+            for (int x = cx * HIZ_COARSE; x < x1; x++) zmin = min(zmin, cellMin[x + y * width]);
+        }
+        coarseMin[cx + cy * coarseWidth] = zmin;
+    }
+};
+
+// depth and color storage a tile is rasterized into, one per worker thread.
+// Storage starts on the raster block grid and is padded, so every block touching the tile is in memory.
+class TileBuffer {
+public :
+    TileBuffer(int width, int height, PixelFormat format, int samples = 1) : stride((width + 2 * BLOCK_WIDTH - 2) / BLOCK_WIDTH * BLOCK_WIDTH),
+        rows((height + 2 * BLOCK_HEIGHT - 2) / BLOCK_HEIGHT * BLOCK_HEIGHT), samples(samples),
+        zBuffer(stride * rows * samples), target(stride * samples, rows, format), hiZ(stride, rows) {}
+
+    int x0, y0, x1, y1; // tile rect
+    int ox, oy;         // screen position of the first stored pixel
+    int stride, rows;
+    int samples;           // per pixel; a pixel's samples are next to each other in zBuffer and in a target row
+    vector<float> zBuffer;
+    RenderTarget target;
+    HiZBuffer hiZ;
+
+    // visibility buffer, only allocated in visibility buffer mode
+    vector<int> triangleIds; // -1 where nothing was drawn
+    vector<Vector3> barCoos;
+
+    RenderCounters counters;
+    bool countCovered = false; // count the covered pixels of every tile, a pass over its depth
+    // depth tests per screen pixel for the heatmaps, frame sized and shared by the workers; nullptr when off
+    int* depthTests = nullptr;
+    int depthTestsWidth = 0;
+
+    size_t bytes() const {
+        return VectorBytes(zBuffer) + target.pitch() * target.height() + VectorBytes(hiZ.cellMin) + VectorBytes(hiZ.cellMax)
+            + VectorBytes(hiZ.dirty) + VectorBytes(hiZ.coarseMin) + VectorBytes(triangleIds) + VectorBytes(barCoos);
+    }
+
+    void SetRect(int x0, int y0, int x1, int y1) {
+        this->x0 = x0;
+        this->y0 = y0;
+        this->x1 = x1;
+        this->y1 = y1;
+        ox = x0 - x0 % BLOCK_WIDTH;
+        oy = y0 - y0 % BLOCK_HEIGHT;
+    }
+
+    int width() { return x1 - x0; }
+    int height() { return y1 - y0; }
+    bool contains(int x, int y) { return x >= x0 && x < x1 && y >= y0 && y < y1; }
+    int index(int x, int y) { return (x - ox) + (y - oy) * stride; }
+};
+
+// most vertices or facets in one DrawChunk
+#define DRAW_CHUNK_SIZE 4096
+
+// a range of one draw's unique vertices or facets, the unit of work of the vertex and geometry stages
+class DrawChunk {
+public :
+    int draw;
+    int begin, end;
+};
+
+// what a frame allocates, kept from one frame to the next: the thread pool, vertex buffers, triangle and tile lists,
+// the workers' gather and tile buffers, the float frame and the image it is resolved to. Vectors are cleared, not freed,
+// so once the first frame has sized them the frames after it allocate nothing as long as the resolution, tile size
+// and target format stay the same. One frame renders at a time.
+class RenderContext {
+public :
+    explicit RenderContext(int threadCount) : pool(threadCount), gathers(pool.size()), buffers(pool.size()) {
+        for (auto& gather : gathers) gather.resize(DRAW_CHUNK_SIZE);
+    }
+
+    ThreadPool pool;
+    vector<Data> draws;                  // scenes: a copy of the view per visible instance
+    vector<int> visible;                 // scenes: the instances drawn
+    vector<VertexBuffer> vertexBuffers;  // one per draw
+    vector<DrawChunk> vertexChunks;
+    vector<DrawChunk> facetChunks;
+    vector<VertexGather> gathers;        // one per worker, for a vertex chunk
+    vector<vector<Triangle>> chunks;     // the triangles of each facet chunk
+    vector<RenderCounters> chunkCounters;
+    vector<Triangle> triangles;
+    vector<Tile> tiles;
+    vector<unique_ptr<TileBuffer>> buffers; // one per worker, made on first use
+    int bufferWidth = 0, bufferHeight = 0;  // size, format and samples the buffers were made for
+    PixelFormat bufferFormat = PixelFormat::RGBA8;
+    int bufferSamples = 0;
+    RenderTarget frame;
+    TGAImage image; // the last frame, resolved
+    vector<int> depthTests; // heatmaps only
+    vector<float> tileNs;
+};
+
+// A shader is a type with
+//     static constexpr int varyings;                      the Varying bits it reads
+//     static void ShadeVertices(Data& data, int vertBegin, int vertEnd, VertexBuffer& vb, VertexGather& gather);
+//                                                         writes clipPos and the declared varyings of the range;
+//                                                         gather is scratch for at least the range
+//     static ColorF ShadeFragment(Frag& frag, Data& data);   the frag's declared varyings are interpolated,
+//                                                         the color is linear and may go above 1
+// The stages from VertexStage down to ShadeFrag are templates on it, so each shader gets its own rasterizer
+// with the unused varyings and the material branches compiled out.
+
+// the pipeline stages instantiated for one shader, see MakeShaderVariant
+class ShaderVariant {
+public :
+    const char* name;
+    int varyings;
+    void (*vertexStage)(Data& data, int vertBegin, int vertEnd, VertexBuffer& vb, VertexGather& gather);
+    void (*geometryStage)(Data& data, VertexBuffer& vb, int facetBegin, int facetEnd, vector<Triangle>& triangles, RenderCounters& counters);
+    void (*rasterizeTile)(Tile& tile, vector<Triangle>& triangles, Data& data, TileBuffer& buffer, RenderTarget& frame);
+    void (*rasterize)(Triangle& tri, int triIndex, Data& data, TileBuffer& buffer);
+};
+
+// material flags, the key variants are registered and looked up under
+enum ShaderFlags {
+    ShaderNormalMap = 1 << 0,    // the model has a normal map
+    ShaderTangentSpace = 1 << 1, // and it is in tangent space
+};
+
+// pre-instantiated shader variants by material flags
+class ShaderRegistry {
+public :
+    void Register(int flags, const ShaderVariant& variant) { variants[flags] = variant; }
+
+    // nullptr if nothing is registered under exactly these flags
+    const ShaderVariant* Find(int flags) const {
+        auto it = variants.find(flags);
+        return it == variants.end() ? nullptr : &it->second;
+    }
+
+    // true only the first time for these flags, so a missing variant is reported once and not every frame
+    bool FirstMiss(int flags) { return missed.insert(flags).second; }
+
+private :
+    map<int, ShaderVariant> variants;
+    set<int> missed;
+};
+
+// where the built-in shader takes the normal from
+enum class NormalSource { Vertex, ObjectSpaceMap, TangentSpaceMap };
+
+// diffuse and specular maps lit by one point light
+template <NormalSource Source>
+class BlinnPhongShader {
+public :
+    static constexpr int varyings = VaryingUV | VaryingViewPos
+        | (Source != NormalSource::ObjectSpaceMap ? VaryingNormal : 0)
+        | (Source == NormalSource::TangentSpaceMap ? VaryingTangent : 0);
+
+    static void ShadeVertices(Data& data, int vertBegin, int vertEnd, VertexBuffer& vb, VertexGather& gather);
+    static ColorF ShadeFragment(Frag& frag, Data& data);
 };
 
 
 #pragma region Render Pipeline
 
-TGAImage Render(Data& data);
+TGAImage Render(Data& data, RenderStats* stats = nullptr);
+TGAImage RenderScene(Scene& scene, Data& view, RenderStats* stats = nullptr);
+vector<TGAImage> RenderBatch(shared_ptr<const Model> model, vector<Data>& views, vector<RenderStats>* stats = nullptr);
+void RenderSequence(Data& data, int frameCount, const function<void(int, Data&)>& setup,
+    const function<void(int, const TGAImage&)>& write, vector<RenderStats>* stats = nullptr);
+void RenderFrame(Data& data, RenderContext& context, RenderStats* stats, Scene* scene = nullptr);
+double MsSince(chrono::steady_clock::time_point t0);
+void MakeHeatmaps(Data& data, vector<int>& depthTests, vector<float>& tileNs, RenderStats& stats);
 
 void InitData(Data& data);
+void InitModel(Data& data);
+Frustum ViewFrustum(Data& data);
+
+ShaderRegistry& BuiltinShaders();
+int MaterialFlags(Data& data);
+const ShaderVariant* SelectShader(Data& data);
+template <class Shader> ShaderVariant MakeShaderVariant(const char* name);
+
+template <class Shader> void VertexStage(Data& data, int vertBegin, int vertEnd, VertexBuffer& vb, VertexGather& gather);
+template <int Varyings> void VertexShader(Data& data, int vertBegin, int vertEnd, VertexBuffer& vb, VertexGather& gather);
+template <class Shader> void GeometryStage(Data& data, VertexBuffer& vb, int facetBegin, int facetEnd, vector<Triangle>& triangles, RenderCounters& counters);
+template <int Varyings> void AssembleVertex(VertexBuffer& vb, int i, Vertex& v);
+
+float ClipDistance(const Vector4& p, int plane, Data& data);
+int ClipCode(const Vector4& p, Data& data);
+template <int Varyings> Vertex LerpVertex(const Vertex& a, const Vertex& b, float t);
+template <int Varyings> int ClipPolygon(Data& data, int planes, Vertex* poly, int count, Vertex* scratch);
+bool IsBackward(Vertex verts[]);
 
-void VertexShader(Vertex& v, Data& data);
+void ProjToScreen(int i, Data& data, VertexBuffer& vb);
+void ProjToScreen(Data& data, Vertex& v);
+
+void BinTriangles(vector<Triangle>& triangles, Data& data, vector<Tile>& tiles);
+template <class Shader> void RasterizeTile(Tile& tile, vector<Triangle>& triangles, Data& data, TileBuffer& buffer, RenderTarget& frame);
+void RasterizeDraws(Tile& tile, vector<Triangle>& triangles, Data* draws, TileBuffer& buffer, RenderTarget& frame);
+void BeginTile(Tile& tile, Data& data, TileBuffer& buffer);
+void EndTile(Tile& tile, TileBuffer& buffer, RenderTarget& frame);
+int CoveredPixels(TileBuffer& buffer);
+void ResolveSamples(TileBuffer& buffer, RenderTarget& frame);
+
+bool SetupTriangle(Triangle& tri, Data& data);
+template <class Shader> void RasterizeTriangle(Triangle& tri, int triIndex, Data& data, TileBuffer& buffer);
+template <class Shader> void Rasterize(Triangle& tri, int triIndex, Data& data, TileBuffer& tile);
+template <class Shader> void RasterizeMsaa(Triangle& tri, Data& data, TileBuffer& tile);
+template <class Shader> void ShadeBlock(Frag& frag, Data& data, TileBuffer& tile, int x, int y, int pass,
+    float barCoo[3][BLOCK_LANES], const int* sampleMasks);
+template <class Shader> void ShadeVisibilityBuffer(vector<Triangle>& triangles, Data& data, TileBuffer& tile);
+void QuadUVDerivatives(Triangle& tri, int x, int y, Vector2& dUVdx, Vector2& dUVdy);
+int RasterBlockScalar(Triangle& tri, TileBuffer& tile, int x, int y, const int64_t w[3], int laneMask, float barCoo[3][BLOCK_LANES]);
+int RasterBlockMsaa(Triangle& tri, TileBuffer& tile, int x, int y, const int64_t w[3], int laneMask,
+    float barCoo[3][BLOCK_LANES], int sampleMasks[BLOCK_LANES]);
+void CountDepthTests(TileBuffer& tile, int x, int y, int covered);
+Vector3 NdcVertBarCoo(Vector3& screenBarCoo, Vertex verts[]);
 
-bool TestFacet(Vertex verts[]);
-bool IsOutside(Vertex verts[]);
-bool IsBackward(Vertex verts[]);
+bool TestFrag(Frag& frag, TileBuffer& tile, int sample = 0);
 
-void ProjToScreen(Vertex verts[], Data& data);
+template <class Shader> void ShadeFrag(Frag& frag, Data& data, TileBuffer& tile, int sampleMask = 1);
+template <int Varyings> void InterpolateVaryings(Frag& frag);
+TextureSampler FragSampler(Frag& frag, Data& data);
+template <NormalSource Source> Vector3 CalNormal(Frag& frag, Data& data, const TextureSampler& sampler);
 
-void Rasterize(Vertex verts[], Data& data, float zBuffer[], TGAImage& frameBuffer);
-Vector3 NdcVertBarCoo(Vector3& screenBarCoo, Vertex verts[]);
 
-bool TestFrag(Frag& frag, float zBuffer[], Data& data);
+TGAImage Render(Data& data, RenderStats* stats) {
+    RenderContext context(data.threadCount);
+    RenderFrame(data, context, stats);
+    return move(context.image);
+}
+
+// the scene's instances seen from view, see RenderFrame. The scene must be built.
+TGAImage RenderScene(Scene& scene, Data& view, RenderStats* stats) {
+    RenderContext context(view.threadCount);
+    RenderFrame(view, context, stats, &scene);
+    return move(context.image);
+}
 
-void FragShader(Frag& frag, Data& data, TGAImage& frameBuffer);
-Vector3 CalNormalWithNormalMap(Frag& frag, Data& data);
-void GetTB(Vertex& p0, Vertex& p1, Vertex& p2, Vector3& N, Vector3& T, Vector3& B);
-void GetTB2(Vertex& p0, Vertex& p1, Vertex& p2, Vector3& N, Vector3& T, Vector3& B);
+// renders one model from many views (camera, light, transform and shading settings per view).
+// The views share the model's mesh and textures and one RenderContext; threadCount of the first view is used.
+vector<TGAImage> RenderBatch(shared_ptr<const Model> model, vector<Data>& views, vector<RenderStats>* stats) {
+    vector<TGAImage> images;
+    if (views.empty()) return images;
+    if (stats) stats->assign(views.size(), RenderStats());
+
+    RenderContext context(views[0].threadCount);
+    images.reserve(views.size());
+    for (size_t i = 0; i < views.size(); i++) {
+        views[i].model = model;
+        RenderFrame(views[i], context, stats ? &(*stats)[i] : nullptr);
+        images.push_back(context.image);
+    }
+    return images;
+}
 
+// renders frames [0, frameCount) of a sequence, setup(frame, data) moves the camera, model or light for each.
+// Every finished image goes to write(frame, image) on a background thread while the next frame renders, so
+// encoding and disk writes overlap the rendering; at most one image waits to be written. All frames share one
+// RenderContext and two images, nothing is allocated per frame.
+void RenderSequence(Data& data, int frameCount, const function<void(int, Data&)>& setup,
+    const function<void(int, const TGAImage&)>& write, vector<RenderStats>* stats) {
+    if (stats) stats->assign(max(frameCount, 0), RenderStats());
+
+    RenderContext context(data.threadCount);
+    TGAImage writing;
+    future<void> writer;
+    for (int i = 0; i < frameCount; i++) {
+        setup(i, data);
+        RenderFrame(data, context, stats ? &(*stats)[i] : nullptr);
+        // the image of frame i - 1 is rendered into again by frame i + 1
+        if (writer.valid()) writer.get();
+        swap(writing, context.image);
+        writer = async(launch::async, [&write, &writing, i] { write(i, writing); });
+    }
+    if (writer.valid()) writer.get();
+}
 
-TGAImage Render(Data& data) {
+// renders data's model, or with a scene the instances of it whose bounds touch the view frustum. For a scene
+// data is the view: its model and model transform are not used, each visible instance is drawn with a copy of
+// it that has the instance's model and transform. Every draw goes through the vertex and geometry stages on
+// its own, then the triangles of all of them are binned and rasterized together into the same targets, in
+// instance order. Scenes shade forward, the visibility buffer shades a tile with one shader.
+void RenderFrame(Data& data, RenderContext& context, RenderStats* stats, Scene* scene) {
+    auto frameStart = chrono::steady_clock::now();
+    auto stageStart = frameStart;
+    // wall time since the previous stage ended
+    auto lap = [&]() {
+        double ms = MsSince(stageStart);
+        stageStart = chrono::steady_clock::now();
+        return ms;
+    };
 
-    // init zbuffer
     data.length = data.width() * data.height();
-    float* zBuffer = new float[data.length];
-    for (int i = 0; i < data.length; i++) {
-        zBuffer[i] = -FLT_MAX;
+    auto& pool = context.pool;
+    auto& frame = context.frame;
+    if (frame.width() != data.width() || frame.height() != data.height() || frame.format() != data.targetFormat) {
+        frame = RenderTarget(data.width(), data.height(), data.targetFormat);
     }
 
-    TGAImage frameBuffer(data.width(), data.height(), Format::RGBA);
-
     InitData(data);
-    Vertex verts[3];
-    verts[0].ivert = 0;
-    verts[1].ivert = 1;
-    verts[2].ivert = 2;
-    for (int i = 0; i < data.model.facetCount(); i++) {
-        for (int j = 0; j < 3; j++) {
-            verts[j].ifacet = i;
-            VertexShader(verts[j], data);
+    Data* draws = &data;
+    int drawCount = 1;
+    if (scene) {
+        auto& visible = context.visible;
+        if (data.cullInstances) scene->Cull(ViewFrustum(data), visible);
+        else {
+            visible.resize(scene->instances.size());
+            iota(visible.begin(), visible.end(), 0);
         }
+        auto& sceneDraws = context.draws;
+        sceneDraws.clear();
+        for (auto i : visible) {
+            auto& instance = scene->instances[i];
+            sceneDraws.push_back(data);
+            auto& draw = sceneDraws.back();
+            draw.model = instance.model;
+            draw.modelPos = instance.pos;
+            draw.modelRot = instance.rot;
+            draw.modelScale = instance.scale;
+            draw.visibilityBuffer = false;
+            InitModel(draw);
+        }
+        draws = sceneDraws.data();
+        drawCount = (int)sceneDraws.size();
+    }
+    double setupMs = lap();
+
+    // work split into chunks of at most DRAW_CHUNK_SIZE vertices or facets, no chunk spans two draws
+    auto& vertexBuffers = context.vertexBuffers;
+    auto& vertexChunks = context.vertexChunks;
+    auto& facetChunks = context.facetChunks;
+    if ((int)vertexBuffers.size() < drawCount) vertexBuffers.resize(drawCount);
+    vertexChunks.clear();
+    facetChunks.clear();
+    int vertCount = 0, facetCount = 0;
+    for (int d = 0; d < drawCount; d++) {
+        int verts = draws[d].model->uniqueVertCount(), facets = draws[d].model->facetCount();
+        vertexBuffers[d].resize(verts, draws[d].shader->varyings);
+        for (int i = 0; i < verts; i += DRAW_CHUNK_SIZE) vertexChunks.push_back({ d, i, min(verts, i + DRAW_CHUNK_SIZE) });
+        for (int i = 0; i < facets; i += DRAW_CHUNK_SIZE) facetChunks.push_back({ d, i, min(facets, i + DRAW_CHUNK_SIZE) });
+        vertCount += verts;
+        facetCount += facets;
+    }
 
-        if (!TestFacet(verts)) continue;
-
-        ProjToScreen(verts, data);
-        Rasterize(verts, data, zBuffer, frameBuffer);
+    // vertex: every unique (position, uv, normal) of a draw is transformed once
+    pool.ParallelFor((int)vertexChunks.size(), [&](int i, int worker) {
+        auto& chunk = vertexChunks[i];
+        auto& draw = draws[chunk.draw];
+        draw.shader->vertexStage(draw, chunk.begin, chunk.end, vertexBuffers[chunk.draw], context.gathers[worker]);
+    });
+    double vertexMs = lap();
+
+    // geometry: each chunk keeps its triangles in facet order
+    int chunkCount = (int)facetChunks.size();
+    auto& chunks = context.chunks;
+    auto& chunkCounters = context.chunkCounters;
+    chunks.resize(chunkCount);
+    chunkCounters.assign(chunkCount, RenderCounters());
+    pool.ParallelFor(chunkCount, [&](int i, int) {
+        auto& chunk = facetChunks[i];
+        auto& draw = draws[chunk.draw];
+        chunks[i].clear();
+        draw.shader->geometryStage(draw, vertexBuffers[chunk.draw], chunk.begin, chunk.end, chunks[i], chunkCounters[i]);
+        for (auto& tri : chunks[i]) tri.draw = chunk.draw;
+    });
+    auto& triangles = context.triangles;
+    triangles.clear();
+    for (int i = 0; i < chunkCount; i++) {
+        triangles.insert(triangles.end(), chunks[i].begin(), chunks[i].end());
+    }
+    double geometryMs = lap();
+
+    auto& tiles = context.tiles;
+    BinTriangles(triangles, data, tiles);
+    double binMs = lap();
+
+    // raster: tiles cover disjoint pixels, so they are rasterized and shaded in parallel without locks
+    bool heatmaps = RENDER_STATS && stats && stats->heatmaps;
+    auto& depthTests = context.depthTests;
+    auto& tileNs = context.tileNs;
+    depthTests.assign(heatmaps ? data.length : 0, 0);
+    tileNs.assign(heatmaps ? tiles.size() : 0, 0.f);
+
+    auto& buffers = context.buffers;
+    int bufferWidth = data.tileSize > 0 ? data.tileSize : data.width();
+    int bufferHeight = data.tileSize > 0 ? data.tileSize : data.height();
+    if (bufferWidth != context.bufferWidth || bufferHeight != context.bufferHeight || data.targetFormat != context.bufferFormat
+        || data.samples != context.bufferSamples) {
+        for (auto& buffer : buffers) buffer.reset();
+        context.bufferWidth = bufferWidth;
+        context.bufferHeight = bufferHeight;
+        context.bufferFormat = data.targetFormat;
+        context.bufferSamples = data.samples;
+    }
+    for (auto& buffer : buffers) {
+        if (!buffer) continue;
+        buffer->counters = RenderCounters();
+        buffer->countCovered = stats != nullptr;
+        buffer->depthTests = heatmaps ? depthTests.data() : nullptr;
+        buffer->depthTestsWidth = data.width();
     }
+    pool.ParallelFor((int)tiles.size(), [&](int i, int worker) {
+        if (!buffers[worker]) {
+            buffers[worker] = make_unique<TileBuffer>(bufferWidth, bufferHeight, data.targetFormat, data.samples);
+            buffers[worker]->countCovered = stats != nullptr;
+            buffers[worker]->depthTests = heatmaps ? depthTests.data() : nullptr;
+            buffers[worker]->depthTestsWidth = data.width();
+        }
+        auto tileStart = heatmaps ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+        if (drawCount == 1) draws[0].shader->rasterizeTile(tiles[i], triangles, draws[0], *buffers[worker], frame);
+        else RasterizeDraws(tiles[i], triangles, draws, *buffers[worker], frame);
+        if (heatmaps) tileNs[i] = (float)(MsSince(tileStart) * 1e6);
+    });
+    double rasterMs = lap();
+
+    frame.resolve(context.image, data.tonemap, data.exposure);
+    double resolveMs = lap();
+
+    if (stats) {
+        stats->setupMs = setupMs;
+        stats->vertexMs = vertexMs;
+        stats->geometryMs = geometryMs;
+        stats->binMs = binMs;
+        stats->rasterMs = rasterMs;
+        stats->resolveMs = resolveMs;
+        stats->totalMs = MsSince(frameStart);
+        stats->verticesIn = facetCount * 3;
+        stats->verticesShaded = vertCount;
+        stats->trianglesIn = facetCount;
+        stats->trianglesRasterized = (int)triangles.size();
+
+        RenderCounters sum;
+        for (auto& c : chunkCounters) sum.Add(c);
+        size_t bytes = VectorBytes(triangles) + frame.pitch() * frame.height();
+        bytes += VectorBytes(depthTests) + VectorBytes(tileNs);
+        bytes += VectorBytes(context.draws) + VectorBytes(context.visible) + VectorBytes(vertexChunks) + VectorBytes(facetChunks);
+        for (auto& vb : vertexBuffers) bytes += vb.bytes();
+        for (auto& gather : context.gathers) bytes += gather.bytes();
+        for (auto& chunk : chunks) bytes += VectorBytes(chunk);
+        for (auto& tile : tiles) bytes += sizeof(Tile) + VectorBytes(tile.triangles);
+        for (auto& buffer : buffers) {
+            if (!buffer) continue;
+            sum.Add(buffer->counters);
+            bytes += buffer->bytes();
+        }
+        stats->frustumCulled = sum.frustumCulled;
+        stats->clipped = sum.clipped;
+        stats->backfacing = sum.backfacing;
+        stats->dropped = sum.dropped;
+        stats->tilesOccluded = sum.occluded;
+        stats->fragmentsTested = sum.fragmentsTested;
+        stats->depthRejected = sum.fragmentsTested - sum.fragmentsPassed;
+        stats->fragmentsShaded = sum.fragmentsShaded;
+        stats->pixelsCovered = sum.pixelsCovered;
+        stats->shadeMs = sum.shadeMs;
+        stats->instancesIn = scene ? (int)scene->instances.size() : 1;
+        stats->instancesCulled = scene ? stats->instancesIn - drawCount : 0;
+        stats->scratchBytes = bytes;
+        if (heatmaps) MakeHeatmaps(data, depthTests, tileNs, *stats);
+    }
+}
 
-    return frameBuffer;
+double MsSince(chrono::steady_clock::time_point t0) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+}
+
+// the diagnostic maps from the frame's depth tests per pixel and the time of every render tile
+void MakeHeatmaps(Data& data, vector<int>& depthTests, vector<float>& tileNs, RenderStats& stats) {
+    int w = data.width(), h = data.height();
+    vector<float> pixels(depthTests.begin(), depthTests.end());
+    stats.maxDepthTests = depthTests.empty() ? 0 : *max_element(depthTests.begin(), depthTests.end());
+    stats.depthComplexityMap = HeatmapImage(pixels, w, h, 1, (float)stats.maxDepthTests);
+
+    int cellsX = (w + HEATMAP_TILE - 1) / HEATMAP_TILE, cellsY = (h + HEATMAP_TILE - 1) / HEATMAP_TILE;
+    vector<float> fragments(cellsX * cellsY);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) fragments[x / HEATMAP_TILE + y / HEATMAP_TILE * cellsX] += (float)depthTests[x + y * w];
+    }
+    float maxFragments = *max_element(fragments.begin(), fragments.end());
+    stats.maxTileFragments = (int64_t)maxFragments;
+    stats.tileFragmentMap = HeatmapImage(fragments, w, h, HEATMAP_TILE, maxFragments);
+
+    // the render tiles are laid out like the cells, see BinTriangles
+    int tileSize = data.tileSize > 0 ? data.tileSize : max(w, h);
+    float maxNs = tileNs.empty() ? 0 : *max_element(tileNs.begin(), tileNs.end());
+    stats.maxTileNs = maxNs;
+    stats.tileTimeMap = HeatmapImage(tileNs, w, h, tileSize, maxNs);
 }
 
 void InitData(Data& data) {
     // 
-    data.modelMat = ModelMat(data.modelPos, data.modelRot, data.modelScale);
     data.viewMat = ViewMat(data.camWorldPos, data.camDir, data.camUp);
     data.projMat = PerspectProjMat(data.fovy, data.aspect(), data.near, data.far);
-    data.mvp = data.projMat * data.viewMat * data.modelMat;
     data.viewportMat = ViewportMat(data.width(), data.height());
 
     data.lightNdcPos = TranslatePoint(data.projMat * data.viewMat, data.lightWorldPos);
     data.lightViewPos = TranslatePoint(data.viewMat, data.lightWorldPos);
     data.camNdcPos = TranslatePoint(data.projMat, Vector3::Zero());
-    data.normalTranslateMat = (data.viewMat * data.modelMat).Inverse().Transpose(); // ߱任=mvת
+    data.rasterSimd = ResolveRasterSimd(data.simd);
+    data.samples = data.msaa == MSAA_SAMPLES ? MSAA_SAMPLES : 1;
+
+    // scissor and guard band
+    bool scissor = data.scissorMin.x < data.scissorMax.x && data.scissorMin.y < data.scissorMax.y;
+    data.drawX0 = scissor ? max(data.scissorMin.x, 0) : 0;
+    data.drawY0 = scissor ? max(data.scissorMin.y, 0) : 0;
+    data.drawX1 = scissor ? min(data.scissorMax.x, data.width()) : data.width();
+    data.drawY1 = scissor ? min(data.scissorMax.y, data.height()) : data.height();
+    data.guardBandX = GUARD_BAND / (data.width() / 2.f);
+    data.guardBandY = GUARD_BAND / (data.height() / 2.f);
+
+    InitModel(data);
+}
+
+// the model matrices and the shader of the material; InitData ends with it. A scene draws each instance with
+// a copy of the initialized view, this sets the copy up for the instance's model and transform.
+void InitModel(Data& data) {
+    data.modelMat = ModelMat(data.modelPos, data.modelRot, data.modelScale);
+    data.mvp = data.projMat * data.viewMat * data.modelMat;
+    data.mvMat = data.viewMat * data.modelMat;
+    data.modelAffine = Affine3x4(data.modelMat);
+    data.mvAffine = Affine3x4(data.mvMat);
+    data.normalAffine = data.mvAffine.NormalMatrix();
+    data.normalTranslateMat = data.normalAffine.ToMatrix(); // ߱任=mvת
+    data.tangentHandedness = data.mvAffine.Det() < 0 ? -1.f : 1.f;
+    data.shader = data.model ? SelectShader(data) : nullptr;
+}
+
+// the planes of ClipDistance's view frustum in world space. A plane's clip distance is linear in the clip
+// position, so in world space it is the same combination of the columns of proj * view.
+Frustum ViewFrustum(Data& data) {
+    auto viewProj = data.projMat * data.viewMat;
+    Frustum frustum;
+    for (int plane = 0; plane < 6; plane++) {
+        float c[4];
+        for (int j = 0; j < 4; j++) {
+            c[j] = ClipDistance(Vector4(viewProj.data[0][j], viewProj.data[1][j], viewProj.data[2][j], viewProj.data[3][j]), plane, data);
+        }
+        float length = Vector3(c[0], c[1], c[2]).Magnitude();
+        frustum.planes[plane] = Vector4(c[0] / length, c[1] / length, c[2] / length, c[3] / length);
+    }
+    return frustum;
+}
+
+template <class Shader>
+ShaderVariant MakeShaderVariant(const char* name) {
+    return { name, Shader::varyings, VertexStage<Shader>, GeometryStage<Shader>, RasterizeTile<Shader>, RasterizeTriangle<Shader> };
+}
+
+// one BlinnPhongShader instantiation per normal source
+ShaderRegistry& BuiltinShaders() {
+    static ShaderRegistry registry = [] {
+        ShaderRegistry r;
+        r.Register(0, MakeShaderVariant<BlinnPhongShader<NormalSource::Vertex>>("BlinnPhong"));
+        r.Register(ShaderNormalMap, MakeShaderVariant<BlinnPhongShader<NormalSource::ObjectSpaceMap>>("BlinnPhong ObjectSpaceMap"));
+        r.Register(ShaderNormalMap | ShaderTangentSpace, MakeShaderVariant<BlinnPhongShader<NormalSource::TangentSpaceMap>>("BlinnPhong TangentSpaceMap"));
+        return r;
+    }();
+    return registry;
+}
+
+int MaterialFlags(Data& data) {
+    int flags = 0;
+    if (data.model->hasNormalMap()) {
+        flags |= ShaderNormalMap;
+        if (data.isTangentSpaceNormalMap) flags |= ShaderTangentSpace;
+    }
+    return flags;
+}
+
+// the variant registered under the material's flags, the built-in one for them if the registry has none;
+// the first miss of each flags is reported, later ones fall back silently
+const ShaderVariant* SelectShader(Data& data) {
+    int flags = MaterialFlags(data);
+    if (data.shaders) {
+        if (auto variant = data.shaders->Find(flags)) return variant;
+        if (data.shaders->FirstMiss(flags))
+            cerr << "no shader registered for material flags " << flags << ", using the built-in one" << endl;
+    }
+    return BuiltinShaders().Find(flags);
+}
+
+// vertex shading and screen mapping for unique vertices [vertBegin, vertEnd)
+template <class Shader>
+void VertexStage(Data& data, int vertBegin, int vertEnd, VertexBuffer& vb, VertexGather& gather) {
+    Shader::ShadeVertices(data, vertBegin, vertEnd, vb, gather);
+    for (int i = vertBegin; i < vertEnd; i++) {
+        ProjToScreen(i, data, vb);
+    }
+}
+
+// triangle assembly from the vertex buffer, culling and setup for facets [facetBegin, facetEnd)
+template <class Shader>
+void GeometryStage(Data& data, VertexBuffer& vb, int facetBegin, int facetEnd, vector<Triangle>& triangles, RenderCounters& counters) {
+    Triangle tri;
+    auto verts = tri.verts;
+    Vertex poly[CLIP_MAX_VERTS], scratch[CLIP_MAX_VERTS];
+    auto emit = [&]() {
+        if (IsBackward(verts)) {
+            COUNT_STAT(counters.backfacing++);
+            return;
+        }
+        if (!SetupTriangle(tri, data)) {
+            COUNT_STAT(counters.dropped++);
+            return;
+        }
+        triangles.push_back(tri);
+    };
+
+    for (int i = facetBegin; i < facetEnd; i++) {
+        int index[3], codes[3];
+        for (int j = 0; j < 3; j++) {
+            index[j] = data.model->uniqueVertIndex(i, j);
+            codes[j] = vb.clipCodes[index[j]];
+        }
+        // all three outside the same plane of the view frustum
+        if (codes[0] & codes[1] & codes[2] & CLIP_FRUSTUM) {
+            COUNT_STAT(counters.frustumCulled++);
+            continue;
+        }
+
+        for (int j = 0; j < 3; j++) {
+            verts[j].ifacet = i;
+            verts[j].ivert = j;
+            AssembleVertex<Shader::varyings>(vb, index[j], verts[j]);
+        }
+        if constexpr (HasVarying(Shader::varyings, VaryingTangent)) {
+            tri.bitangentSign = data.tangentHandedness * data.model->uniqueVertTangent(index[0]).w;
+        }
+
+        int planes = (codes[0] | codes[1] | codes[2]) & CLIP_CLIPPED;
+        if (!planes) {
+            emit();
+            continue;
+        }
+
+        // what is left of the facet is convex, it is drawn as a fan around its first vertex
+        COUNT_STAT(counters.clipped++);
+        for (int j = 0; j < 3; j++) poly[j] = verts[j];
+        int count = ClipPolygon<Shader::varyings>(data, planes, poly, 3, scratch);
+        for (int k = 1; k + 1 < count; k++) {
+            verts[0] = poly[0];
+            verts[1] = poly[k];
+            verts[2] = poly[k + 1];
+            for (int j = 0; j < 3; j++) verts[j].ivert = j;
+            emit();
+        }
+    }
+}
+
+template <int Varyings>
+void AssembleVertex(VertexBuffer& vb, int i, Vertex& v) {
+    v.clipPos = vb.clipPos[i];
+    v.ndcPos = vb.ndcPos[i];
+    v.homScreenPos = vb.homScreenPos[i];
+    v.screenPos = vb.screenPos[i];
+    if constexpr (HasVarying(Varyings, VaryingUV)) v.uv = vb.uv[i];
+    if constexpr (HasVarying(Varyings, VaryingWorldPos)) v.worldPos = vb.worldPos[i];
+    if constexpr (HasVarying(Varyings, VaryingViewPos)) v.viewPos = vb.viewPos[i];
+    if constexpr (HasVarying(Varyings, VaryingNormal)) v.normal = vb.normal[i];
+    if constexpr (HasVarying(Varyings, VaryingTangent)) v.tangent = vb.tangent[i];
 }
 
 // ɫ:uvndc꣬㷨
-void VertexShader(Vertex& v, Data& data) {
-    // ndc 
-    auto& localPos = data.model.vertPos(v.ifacet, v.ivert);
-    v.ndcPos = TranslatePoint(data.mvp, localPos);
-    v.viewPos = TranslatePoint(data.viewMat * data.modelMat, localPos);
-    v.worldPos = TranslatePoint(data.modelMat, localPos);
+template <int Varyings>
+void VertexShader(Data& data, int vertBegin, int vertEnd, VertexBuffer& vb, VertexGather& gather) {
+    // the model's attributes of the range are gathered, then each transform runs over all of them
+    int count = vertEnd - vertBegin;
+    auto localPos = gather.pos.data(), localNormal = gather.normal.data(), localTangent = gather.tangent.data();
+    for (int k = 0; k < count; k++) {
+        int i = vertBegin + k;
+        localPos[k] = data.model->uniqueVertPos(i);
+        if constexpr (HasVarying(Varyings, VaryingNormal)) localNormal[k] = data.model->uniqueVertNormal(i).Normalized();
+        if constexpr (HasVarying(Varyings, VaryingTangent)) localTangent[k] = data.model->uniqueVertTangent(i);
+        // uv
+        if constexpr (HasVarying(Varyings, VaryingUV)) vb.uv[i] = data.model->uniqueVertUV(i);
+    }
 
-    // uv
-    v.uv = data.model.vertUV(v.ifacet, v.ivert);
+    // ndc 
+    TransformPoints(data.mvp, localPos, &vb.clipPos[vertBegin], count);
+    if constexpr (HasVarying(Varyings, VaryingViewPos)) TransformPoints(data.mvAffine, localPos, &vb.viewPos[vertBegin], count);
+    if constexpr (HasVarying(Varyings, VaryingWorldPos)) TransformPoints(data.modelAffine, localPos, &vb.worldPos[vertBegin], count);
 
     // 㷨
-    auto& vertNormal = data.model.vertNormal(v.ifacet, v.ivert).Normalized();
-    v.normal = TranslateDir(data.normalTranslateMat, vertNormal);
-}
+    // tangents lie in the surface, so they transform like positions
+    if constexpr (HasVarying(Varyings, VaryingNormal)) TransformDirs(data.normalAffine, localNormal, &vb.normal[vertBegin], count);
+    if constexpr (HasVarying(Varyings, VaryingTangent)) TransformDirs(data.mvAffine, localTangent, &vb.tangent[vertBegin], count);
 
-bool TestFacet(Vertex verts[]) {
-    return !IsOutside(verts) && !IsBackward(verts);
+    for (int i = vertBegin; i < vertEnd; i++) {
+        if constexpr (HasVarying(Varyings, VaryingNormal)) vb.normal[i] = vb.normal[i].Normalized();
+        if constexpr (HasVarying(Varyings, VaryingTangent)) vb.tangent[i] = vb.tangent[i].Normalized();
+    }
 }
 
 // ü޳
-bool IsOutside(Vertex verts[]) {
-    for (int i = 0; i < 3; i++)
-    {
-        auto& v = verts[i];
-        auto& p = v.ndcPos;
-        if (p.x >= -1 && p.x <= 1 && p.y >= -1 && p.y <= 1 && p.z >= -1 && p.z <= 1) return false;
+// Plane i bounds ndc axis i / 2 from below (even i) or from above (odd i): planes 0-5 at +-1 are the view frustum,
+// 6-9 at the guard band in x and y. Clip w is the view z, negative in front of the camera, so ndc <= bound is
+// p >= bound * w. Returns the signed distance, >= 0 inside.
+float ClipDistance(const Vector4& p, int plane, Data& data) {
+    float bound = plane < 6 ? 1 : plane < 8 ? data.guardBandX : data.guardBandY;
+    int axis = plane % 6 / 2;
+    return plane & 1 ? p[axis] - bound * p.w : -bound * p.w - p[axis];
+}
+
+int ClipCode(const Vector4& p, Data& data) {
+    int code = 0;
+    for (int plane = 0; plane < CLIP_PLANES; plane++) {
+        if (ClipDistance(p, plane, data) < 0) code |= 1 << plane;
     }
+    return code;
+}
 
-    return true;
+// clip-space point and varyings at t along a -> b; screen mapping is left to ProjToScreen
+template <int Varyings>
+Vertex LerpVertex(const Vertex& a, const Vertex& b, float t) {
+    Vertex v;
+    v.ifacet = a.ifacet;
+    v.clipPos = Vector4(a.clipPos.x + t * (b.clipPos.x - a.clipPos.x), a.clipPos.y + t * (b.clipPos.y - a.clipPos.y),
+        a.clipPos.z + t * (b.clipPos.z - a.clipPos.z), a.clipPos.w + t * (b.clipPos.w - a.clipPos.w));
+    if constexpr (HasVarying(Varyings, VaryingUV)) v.uv = a.uv + t * (b.uv - a.uv);
+    if constexpr (HasVarying(Varyings, VaryingViewPos)) v.viewPos = a.viewPos + t * (b.viewPos - a.viewPos);
+    if constexpr (HasVarying(Varyings, VaryingWorldPos)) v.worldPos = a.worldPos + t * (b.worldPos - a.worldPos);
+    if constexpr (HasVarying(Varyings, VaryingNormal)) v.normal = a.normal + t * (b.normal - a.normal);
+    if constexpr (HasVarying(Varyings, VaryingTangent)) v.tangent = a.tangent + t * (b.tangent - a.tangent);
+    return v;
+}
+
+// Sutherland-Hodgman in clip space against each plane in the mask. poly and scratch hold CLIP_MAX_VERTS;
+// returns the vertex count of the clipped polygon in poly, screen mapped, or < 3 if nothing is left.
+template <int Varyings>
+int ClipPolygon(Data& data, int planes, Vertex* poly, int count, Vertex* scratch) {
+    for (int plane = 0; plane < CLIP_PLANES; plane++) {
+        if (!(planes & (1 << plane))) continue;
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            auto& a = poly[i];
+            auto& b = poly[(i + 1) % count];
+            float da = ClipDistance(a.clipPos, plane, data);
+            float db = ClipDistance(b.clipPos, plane, data);
+            if (da >= 0) scratch[n++] = a;
+            // always from the inside vertex, so facets sharing the edge get the same point
+            if (da >= 0 && db < 0) scratch[n++] = LerpVertex<Varyings>(a, b, da / (da - db));
+            else if (da < 0 && db >= 0) scratch[n++] = LerpVertex<Varyings>(b, a, db / (db - da));
+        }
+        for (int i = 0; i < n; i++) poly[i] = scratch[i];
+        count = n;
+        if (count < 3) return 0;
+    }
+    for (int i = 0; i < count; i++) ProjToScreen(data, poly[i]);
+    return count;
 }
 
 bool IsBackward(Vertex verts[]) {
@@ -197,43 +1221,511 @@ bool IsBackward(Vertex verts[]) {
 }
 
 // Ļӳ
-void ProjToScreen(Vertex verts[], Data& data) {
-    for (int i = 0; i < 3; i++)
-    {
-        auto& v = verts[i];
-        v.homScreenPos = data.viewportMat * HomogeneousCoordinate(v.ndcPos, true);
-        v.screenPos = HomogeneousDivide(v.homScreenPos);
+void ProjToScreen(int i, Data& data, VertexBuffer& vb) {
+    vb.ndcPos[i] = HomogeneousDivide(vb.clipPos[i]);
+    vb.clipCodes[i] = ClipCode(vb.clipPos[i], data);
+    vb.homScreenPos[i] = data.viewportMat * HomogeneousCoordinate(vb.ndcPos[i], true);
+    vb.screenPos[i] = HomogeneousDivide(vb.homScreenPos[i]);
+}
+
+void ProjToScreen(Data& data, Vertex& v) {
+    v.ndcPos = HomogeneousDivide(v.clipPos);
+    v.homScreenPos = data.viewportMat * HomogeneousCoordinate(v.ndcPos, true);
+    v.screenPos = HomogeneousDivide(v.homScreenPos);
+}
+
+// triangle setup: snap to fixed point, build edge functions with the top-left fill rule and the pixel bounding box,
+// clamped to the scissor rect. Degenerate triangles, triangles beyond the fixed-point range and triangles whose
+// box is empty are dropped.
+bool SetupTriangle(Triangle& tri, Data& data) {
+    auto verts = tri.verts;
+    auto& setup = tri.setup;
+
+    int64_t x[3], y[3];
+    for (int i = 0; i < 3; i++) {
+        auto& p = verts[i].screenPos;
+        if (!(fabs(p.x) < MAX_RASTER_COORD && fabs(p.y) < MAX_RASTER_COORD)) return false;
+        x[i] = toFixed(p.x);
+        y[i] = toFixed(p.y);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        int j = (i + 1) % 3;
+        int k = (i + 2) % 3;
+        setup.edges[i] = EdgeFunction(x[j], y[j], x[k], y[k]);
+    }
+    auto area = setup.edges[0].AtFixed(x[0], y[0]);
+    if (area == 0) return false;
+    if (area < 0) {
+        for (auto& e : setup.edges) e.Flip();
+        area = -area;
+    }
+    for (auto& e : setup.edges) {
+        e.bias = e.IsTopLeft() ? 0 : -1;
+    }
+    setup.invArea = 1.f / area;
+    for (int i = 0; i < 3; i++) {
+        setup.w[i] = verts[i].homScreenPos.w;
+        setup.z[i] = verts[i].ndcPos.z;
+    }
+
+    // with msaa a pixel is touched when any of its samples is inside
+    int64_t reach = data.samples > 1 ? MSAA_REACH : 0;
+    setup.xmin = max(fixedCeil(min(x[0], min(x[1], x[2])) - reach), data.drawX0);
+    setup.xmax = min(fixedFloor(max(x[0], max(x[1], x[2])) + reach), data.drawX1 - 1);
+    setup.ymin = max(fixedCeil(min(y[0], min(y[1], y[2])) - reach), data.drawY0);
+    setup.ymax = min(fixedFloor(max(y[0], max(y[1], y[2])) + reach), data.drawY1 - 1);
+    return setup.xmin <= setup.xmax && setup.ymin <= setup.ymax;
+}
+
+// binning: sort triangles into screen tiles by bounding box, keeping submission order inside each tile.
+// The tiles' triangle lists keep their capacity from the last frame.
+void BinTriangles(vector<Triangle>& triangles, Data& data, vector<Tile>& tiles) {
+    int tileSize = data.tileSize > 0 ? data.tileSize : max(data.width(), data.height());
+    int tilesX = (data.width() + tileSize - 1) / tileSize;
+    int tilesY = (data.height() + tileSize - 1) / tileSize;
+
+    tiles.resize(tilesX * tilesY);
+    for (int ty = 0; ty < tilesY; ty++) {
+        for (int tx = 0; tx < tilesX; tx++) {
+            auto& tile = tiles[tx + ty * tilesX];
+            tile.x0 = tx * tileSize;
+            tile.y0 = ty * tileSize;
+            tile.x1 = min(tile.x0 + tileSize, data.width());
+            tile.y1 = min(tile.y0 + tileSize, data.height());
+            tile.triangles.clear();
+        }
+    }
+
+    // bounding boxes are inside the scissor rect already
+    for (int i = 0; i < (int)triangles.size(); i++) {
+        auto& setup = triangles[i].setup;
+        for (int ty = setup.ymin / tileSize; ty <= setup.ymax / tileSize; ty++) {
+            for (int tx = setup.xmin / tileSize; tx <= setup.xmax / tileSize; tx++) {
+                tiles[tx + ty * tilesX].triangles.push_back(i);
+            }
+        }
+    }
+}
+
+// rasterize one tile into the worker's buffer, then copy the finished pixels to the frame
+template <class Shader>
+void RasterizeTile(Tile& tile, vector<Triangle>& triangles, Data& data, TileBuffer& buffer, RenderTarget& frame) {
+    if (tile.triangles.empty()) {
+        // the frame may hold the last frame's pixels
+        frame.clearRect(tile.x0, tile.y0, tile.x1 - tile.x0, tile.y1 - tile.y0);
+        return;
+    }
+
+    BeginTile(tile, data, buffer);
+    for (auto i : tile.triangles) RasterizeTriangle<Shader>(triangles[i], i, data, buffer);
+
+    if (data.visibilityBuffer && buffer.samples == 1) {
+#if RENDER_STATS
+        auto t0 = chrono::steady_clock::now();
+#endif
+        ShadeVisibilityBuffer<Shader>(triangles, data, buffer);
+        COUNT_STAT(buffer.counters.shadeMs += MsSince(t0));
+    }
+    EndTile(tile, buffer, frame);
+}
+
+// RasterizeTile for a tile of triangles from several draws, each rasterized and shaded with its draw's data and shader
+void RasterizeDraws(Tile& tile, vector<Triangle>& triangles, Data* draws, TileBuffer& buffer, RenderTarget& frame) {
+    if (tile.triangles.empty()) {
+        frame.clearRect(tile.x0, tile.y0, tile.x1 - tile.x0, tile.y1 - tile.y0);
+        return;
+    }
+
+    BeginTile(tile, draws[triangles[tile.triangles[0]].draw], buffer);
+    for (auto i : tile.triangles) {
+        auto& draw = draws[triangles[i].draw];
+        draw.shader->rasterize(triangles[i], i, draw, buffer);
+    }
+    EndTile(tile, buffer, frame);
+}
+
+// points the worker's buffer at the tile and clears it
+void BeginTile(Tile& tile, Data& data, TileBuffer& buffer) {
+    buffer.SetRect(tile.x0, tile.y0, tile.x1, tile.y1);
+    fill(buffer.zBuffer.begin(), buffer.zBuffer.end(), -FLT_MAX);
+    buffer.hiZ.Clear();
+    buffer.target.clear();
+
+    if (data.visibilityBuffer && buffer.samples == 1) {
+        buffer.triangleIds.resize(buffer.zBuffer.size());
+        buffer.barCoos.resize(buffer.zBuffer.size());
+        fill(buffer.triangleIds.begin(), buffer.triangleIds.end(), -1);
+    }
+}
+
+// the finished tile to the frame
+void EndTile(Tile& tile, TileBuffer& buffer, RenderTarget& frame) {
+    COUNT_STAT(if (buffer.countCovered) buffer.counters.pixelsCovered += CoveredPixels(buffer));
+
+    if (buffer.samples > 1) ResolveSamples(buffer, frame);
+    else frame.copyRect(buffer.target, tile.x0 - buffer.ox, tile.y0 - buffer.oy, tile.x0, tile.y0, buffer.width(), buffer.height());
+}
+
+// pixels of the buffer's tile with a depth written to any of their samples
+int CoveredPixels(TileBuffer& buffer) {
+    int count = 0;
+    for (int y = buffer.y0; y < buffer.y1; y++) {
+        auto row = &buffer.zBuffer[buffer.index(buffer.x0, y) * buffer.samples];
+        for (int x = 0; x < buffer.width() * buffer.samples; x += buffer.samples) {
+            bool covered = false;
+            for (int s = 0; s < buffer.samples; s++) covered |= row[x + s] != -FLT_MAX;
+            count += covered;
+        }
     }
+    return count;
+}
+
+// the msaa resolve: every pixel of the buffer's tile gets the mean of its samples
+void ResolveSamples(TileBuffer& buffer, RenderTarget& frame) {
+    float weight = 1.f / buffer.samples;
+    for (int y = buffer.y0; y < buffer.y1; y++) {
+        for (int x = buffer.x0; x < buffer.x1; x++) {
+            int sx = (x - buffer.ox) * buffer.samples, sy = y - buffer.oy;
+            auto sum = buffer.target.load(sx, sy);
+            for (int s = 1; s < buffer.samples; s++) sum = sum + buffer.target.load(sx + s, sy);
+            frame.store(x, y, sum * weight);
+        }
+    }
+}
+
+// one triangle of a tile, with msaa when the buffer has the samples for it
+template <class Shader>
+void RasterizeTriangle(Triangle& tri, int triIndex, Data& data, TileBuffer& buffer) {
+    if (buffer.samples > 1) RasterizeMsaa<Shader>(tri, data, buffer);
+    else Rasterize<Shader>(tri, triIndex, data, buffer);
 }
 
 // դ: ƬĻ꣬Ƭ
-void Rasterize(Vertex verts[], Data& data, float zBuffer[], TGAImage& frameBuffer) {
-    auto& frag = Frag();
+template <class Shader>
+void Rasterize(Triangle& tri, int triIndex, Data& data, TileBuffer& tile) {
+    auto verts = tri.verts;
+    auto& setup = tri.setup;
+    Frag frag;
+    frag.tri = &tri;
+    frag.verts = verts;
+
+    // Χ, clamped to the tile
+    int xmin = max(setup.xmin, tile.x0);
+    int ymin = max(setup.ymin, tile.y0);
+    int xmax = min(setup.xmax, tile.x1 - 1);
+    int ymax = min(setup.ymax, tile.y1 - 1);
+    if (xmin > xmax || ymin > ymax) return;
+
+    // depth range of the triangle, widened by a few ulps for the rounding in the interpolation.
+    // Only valid while the perspective barycentrics are convex, i.e. every w > 0.
+    auto& hiZ = tile.hiZ;
+    bool useHiZ = data.hierarchicalZ && setup.w[0] > 0 && setup.w[1] > 0 && setup.w[2] > 0;
+    float zmin = min(setup.z[0], min(setup.z[1], setup.z[2]));
+    float zmax = max(setup.z[0], max(setup.z[1], setup.z[2]));
+    float slack = max(fabs(zmin), fabs(zmax)) * 1e-6f;
+    zmin -= slack;
+    zmax += slack;
+    if (useHiZ && hiZ.Occluded(xmin - tile.ox, ymin - tile.oy, xmax - tile.ox, ymax - tile.oy, zmax)) {
+        COUNT_STAT(tile.counters.occluded++);
+        return;
+    }
+
+    // walk the 8x8 hi-z cells, and the 4x2 blocks of the screen-aligned block grid inside each cell
+    int bxmin = xmin - xmin % BLOCK_WIDTH;
+    int bymin = ymin - ymin % BLOCK_HEIGHT;
+    int cxmin = xmin - (xmin - tile.ox) % HIZ_CELL;
+    int cymin = ymin - (ymin - tile.oy) % HIZ_CELL;
+    int64_t blockStepX[3], blockStepY[3];
+    for (int i = 0; i < 3; i++) {
+        blockStepX[i] = setup.edges[i].StepX() * BLOCK_WIDTH;
+        blockStepY[i] = setup.edges[i].StepY() * BLOCK_HEIGHT;
+    }
+
+    float barCoo[3][BLOCK_LANES];
+    for (int cy = cymin; cy <= ymax; cy += HIZ_CELL) {
+        for (int cx = cxmin; cx <= xmax; cx += HIZ_CELL) {
+            int cell = hiZ.cell(cx - tile.ox, cy - tile.oy);
+            if (useHiZ && hiZ.CellOccluded(cell, zmax, tile.zBuffer)) continue;
+
+            // trivial accept: the triangle covers the whole cell and lies in front of all of it,
+            // so every pixel gets overwritten and the cell's new depth range is the triangle's
+            bool accept = useHiZ && zmin > hiZ.cellMax[cell]
+                && cx >= tile.x0 && cy >= tile.y0 && cx + HIZ_CELL <= tile.x1 && cy + HIZ_CELL <= tile.y1;
+            for (int i = 0; accept && i < 3; i++) {
+                auto& e = setup.edges[i];
+                int xs[2] = { cx, cx + HIZ_CELL - 1 }, ys[2] = { cy, cy + HIZ_CELL - 1 };
+                for (int c = 0; c < 4; c++) {
+                    if (e.At(xs[c & 1], ys[c >> 1]) + e.bias < 0) accept = false;
+                }
+            }
+
+            int bx0 = max(cx, bxmin), by0 = max(cy, bymin);
+            int bx1 = min(cx + HIZ_CELL - 1, xmax), by1 = min(cy + HIZ_CELL - 1, ymax);
+            int64_t row[3];
+            for (int i = 0; i < 3; i++) row[i] = setup.edges[i].At(bx0, by0);
+
+            int written = 0;
+            for (int by = by0; by <= by1; by += BLOCK_HEIGHT) {
+                int rowMask = (by >= ymin ? 0x0F : 0) | (by + 1 <= ymax ? 0xF0 : 0);
+                int64_t w[3] = { row[0], row[1], row[2] };
+                for (int bx = bx0; bx <= bx1; bx += BLOCK_WIDTH) {
+                    // lanes inside the clamped bounding box
+                    int lo = max(xmin - bx, 0);
+                    int hi = min(xmax - bx, BLOCK_WIDTH - 1);
+                    int colMask = (1 << (hi + 1)) - (1 << lo);
+                    int laneMask = rowMask & (colMask | colMask << BLOCK_WIDTH);
+
+                    int result;
+                    switch (data.rasterSimd) {
+#if RASTER_SIMD
+                    case RasterSimd::AVX2:
+                        result = RasterBlockAVX2(setup, w, laneMask, &tile.zBuffer[tile.index(bx, by)], &tile.zBuffer[tile.index(bx, by + 1)], barCoo);
+                        break;
+                    case RasterSimd::SSE41:
+                        result = RasterBlockSSE41(setup, w, laneMask, &tile.zBuffer[tile.index(bx, by)], &tile.zBuffer[tile.index(bx, by + 1)], barCoo);
+                        break;
+#endif
+                    default:
+                        result = RasterBlockScalar(tri, tile, bx, by, w, laneMask, barCoo);
+                        break;
+                    }
+                    int pass = result & BLOCK_PASS_MASK;
+                    COUNT_STAT(tile.counters.fragmentsTested += LaneCount(result >> BLOCK_LANES));
+                    COUNT_STAT(tile.counters.fragmentsPassed += LaneCount(pass));
+                    COUNT_STAT(if (tile.depthTests) CountDepthTests(tile, bx, by, result >> BLOCK_LANES));
+                    written |= pass;
+
+                    if (data.visibilityBuffer) {
+                        // defer shading: only the last fragment to pass the depth test gets shaded
+                        for (int lane = 0; pass; lane++, pass >>= 1) {
+                            if (!(pass & 1)) continue;
+                            auto index = tile.index(bx + lane % BLOCK_WIDTH, by + lane / BLOCK_WIDTH);
+                            tile.triangleIds[index] = triIndex;
+                            tile.barCoos[index] = Vector3(barCoo[0][lane], barCoo[1][lane], barCoo[2][lane]);
+                        }
+                    }
+                    else {
+                        ShadeBlock<Shader>(frag, data, tile, bx, by, pass, barCoo, nullptr);
+                    }
+
+                    for (int i = 0; i < 3; i++) w[i] += blockStepX[i];
+                }
+                for (int i = 0; i < 3; i++) row[i] += blockStepY[i];
+            }
+
+            if (accept) hiZ.Overwrite(cell, zmin, zmax);
+            else if (written) hiZ.Update(cell, zmax);
+        }
+    }
+}
+
+// forward shading of the passing lanes of the block at (x, y), as two 2x2 quads that share their uv derivatives.
+// With msaa, sampleMasks holds the samples each lane's color goes to.
+template <class Shader>
+void ShadeBlock(Frag& frag, Data& data, TileBuffer& tile, int x, int y, int pass, float barCoo[3][BLOCK_LANES], const int* sampleMasks) {
+    bool derivatives = HasVarying(Shader::varyings, VaryingUV) && data.textureFilter == TextureFilter::Trilinear;
+    for (int quad = 0; quad < BLOCK_WIDTH / 2; quad++) {
+        int quadPass = pass & (0x33 << (quad * 2));
+        if (!quadPass) continue;
+        if (derivatives) {
+            QuadUVDerivatives(*frag.tri, x + quad * 2, y, frag.uvDx, frag.uvDy);
+        }
+        for (int lane = 0; quadPass; lane++, quadPass >>= 1) {
+            if (!(quadPass & 1)) continue;
+            frag.screenPos = Vector2Int(x + lane % BLOCK_WIDTH, y + lane / BLOCK_WIDTH);
+            frag.barCoo = Vector3(barCoo[0][lane], barCoo[1][lane], barCoo[2][lane]);
+            ShadeFrag<Shader>(frag, data, tile, sampleMasks ? sampleMasks[lane] : 1);
+        }
+    }
+}
 
-    // Χ
-    int xmin, xmax, ymin, ymax;
-    getBoundingBox(verts[0].screenPos, verts[1].screenPos, verts[2].screenPos, xmin, xmax, ymin, ymax);
+// Rasterize with 4x multisampling: coverage and depth per sample, the fragment shader once per pixel for the
+// samples that pass. Walks the same block grid but without the hi-z, which only tracks one depth per pixel.
+template <class Shader>
+void RasterizeMsaa(Triangle& tri, Data& data, TileBuffer& tile) {
+    auto& setup = tri.setup;
+    Frag frag;
+    frag.tri = &tri;
+    frag.verts = tri.verts;
+
+    int xmin = max(setup.xmin, tile.x0);
+    int ymin = max(setup.ymin, tile.y0);
+    int xmax = min(setup.xmax, tile.x1 - 1);
+    int ymax = min(setup.ymax, tile.y1 - 1);
+    if (xmin > xmax || ymin > ymax) return;
+
+    int bxmin = xmin - xmin % BLOCK_WIDTH;
+    int bymin = ymin - ymin % BLOCK_HEIGHT;
+    int64_t row[3];
+    for (int i = 0; i < 3; i++) row[i] = setup.edges[i].At(bxmin, bymin);
+
+    float barCoo[3][BLOCK_LANES];
+    int sampleMasks[BLOCK_LANES];
+    for (int by = bymin; by <= ymax; by += BLOCK_HEIGHT) {
+        int rowMask = (by >= ymin ? 0x0F : 0) | (by + 1 <= ymax ? 0xF0 : 0);
+        int64_t w[3] = { row[0], row[1], row[2] };
+        for (int bx = bxmin; bx <= xmax; bx += BLOCK_WIDTH) {
+            int lo = max(xmin - bx, 0);
+            int hi = min(xmax - bx, BLOCK_WIDTH - 1);
+            int colMask = (1 << (hi + 1)) - (1 << lo);
+            int laneMask = rowMask & (colMask | colMask << BLOCK_WIDTH);
+
+            int result = RasterBlockMsaa(tri, tile, bx, by, w, laneMask, barCoo, sampleMasks);
+            int pass = result & BLOCK_PASS_MASK;
+            COUNT_STAT(tile.counters.fragmentsTested += LaneCount(result >> BLOCK_LANES));
+            COUNT_STAT(tile.counters.fragmentsPassed += LaneCount(pass));
+            COUNT_STAT(if (tile.depthTests) CountDepthTests(tile, bx, by, result >> BLOCK_LANES));
+            if (pass) ShadeBlock<Shader>(frag, data, tile, bx, by, pass, barCoo, sampleMasks);
+
+            for (int i = 0; i < 3; i++) w[i] += setup.edges[i].StepX() * BLOCK_WIDTH;
+        }
+        for (int i = 0; i < 3; i++) row[i] += setup.edges[i].StepY() * BLOCK_HEIGHT;
+    }
+}
 
-    // for each pixel in bounding box
-    for (int x = xmin; x <= xmax; x++) {
-        for (int y = ymin; y <= ymax; y++) {
-            auto& fragScreenPos = Vector2Int(x, y);
+// msaa block kernel: the coverage test and TestFrag at every sample of every lane. A lane passes when any of its
+// samples does, sampleMasks[lane] gets those samples. Its barycentrics are taken at the pixel's sample point when
+// that is inside the triangle and at the first covered sample otherwise, so edge pixels don't shade outside it.
+int RasterBlockMsaa(Triangle& tri, TileBuffer& tile, int x, int y, const int64_t w[3], int laneMask,
+    float barCoo[3][BLOCK_LANES], int sampleMasks[BLOCK_LANES]) {
+    auto& setup = tri.setup;
+    auto edges = setup.edges;
+    Frag frag;
+    frag.tri = &tri;
+    frag.verts = tri.verts;
+
+    int pass = 0, covered = 0;
+    for (int lane = 0; lane < BLOCK_LANES; lane++) {
+        if (!(laneMask & (1 << lane))) continue;
+        int dx = lane % BLOCK_WIDTH;
+        int dy = lane / BLOCK_WIDTH;
+        int64_t pixel[3];
+        for (int i = 0; i < 3; i++) pixel[i] = w[i] + dx * edges[i].StepX() + dy * edges[i].StepY();
+        frag.screenPos = Vector2Int(x + dx, y + dy);
+
+        int coveredSamples = 0, passedSamples = 0, firstSample = -1;
+        for (int s = 0; s < MSAA_SAMPLES; s++) {
+            int64_t e[3];
+            for (int i = 0; i < 3; i++) e[i] = pixel[i] + edges[i].a * MsaaOffsets[s][0] + edges[i].b * MsaaOffsets[s][1];
+            if (((e[0] + edges[0].bias) | (e[1] + edges[1].bias) | (e[2] + edges[2].bias)) < 0) continue;
+            coveredSamples |= 1 << s;
+            if (firstSample < 0) firstSample = s;
+
+            auto screenBarCoo = Vector3(e[0] * setup.invArea, e[1] * setup.invArea, e[2] * setup.invArea);
+            frag.barCoo = NdcVertBarCoo(screenBarCoo, tri.verts);
+            if (TestFrag(frag, tile, s)) passedSamples |= 1 << s;
+        }
+        if (!coveredSamples) continue;
+        covered |= 1 << lane;
+        if (!passedSamples) continue;
 
-            auto& screenBarCoo = barycentricCoordinate((Vector2)fragScreenPos, verts[0].screenPos, verts[1].screenPos, verts[2].screenPos);
+        int64_t e[3] = { pixel[0], pixel[1], pixel[2] };
+        if (((e[0] + edges[0].bias) | (e[1] + edges[1].bias) | (e[2] + edges[2].bias)) < 0) {
+            for (int i = 0; i < 3; i++) e[i] += edges[i].a * MsaaOffsets[firstSample][0] + edges[i].b * MsaaOffsets[firstSample][1];
+        }
+        auto screenBarCoo = Vector3(e[0] * setup.invArea, e[1] * setup.invArea, e[2] * setup.invArea);
+        auto bar = NdcVertBarCoo(screenBarCoo, tri.verts);
+        barCoo[0][lane] = bar.x;
+        barCoo[1][lane] = bar.y;
+        barCoo[2][lane] = bar.z;
+        sampleMasks[lane] = passedSamples;
+        pass |= 1 << lane;
+    }
+    return pass | covered << BLOCK_LANES;
+}
 
-            // ޳Ƭ
-            if (screenBarCoo.x < 0 || screenBarCoo.y < 0 || screenBarCoo.z < 0) continue;
+// reference block kernel: the per-pixel coverage test, NdcVertBarCoo and TestFrag for every lane.
+// w[] are the edge values at pixel (x, y), the block's first pixel.
+int RasterBlockScalar(Triangle& tri, TileBuffer& tile, int x, int y, const int64_t w[3], int laneMask, float barCoo[3][BLOCK_LANES]) {
+    auto& setup = tri.setup;
+    auto& e0 = setup.edges[0];
+    auto& e1 = setup.edges[1];
+    auto& e2 = setup.edges[2];
+    Frag frag;
+    frag.tri = &tri;
+    frag.verts = tri.verts;
+
+    int pass = 0, covered = 0;
+    for (int lane = 0; lane < BLOCK_LANES; lane++) {
+        if (!(laneMask & (1 << lane))) continue;
+        int dx = lane % BLOCK_WIDTH;
+        int dy = lane / BLOCK_WIDTH;
+        int64_t w0 = w[0] + dx * e0.StepX() + dy * e0.StepY();
+        int64_t w1 = w[1] + dx * e1.StepX() + dy * e1.StepY();
+        int64_t w2 = w[2] + dx * e2.StepX() + dy * e2.StepY();
+
+        // ޳Ƭ
+        if (((w0 + e0.bias) | (w1 + e1.bias) | (w2 + e2.bias)) < 0) continue;
+        covered |= 1 << lane;
+
+        auto screenBarCoo = Vector3(w0 * setup.invArea, w1 * setup.invArea, w2 * setup.invArea);
+        frag.screenPos = Vector2Int(x + dx, y + dy);
+        frag.barCoo = NdcVertBarCoo(screenBarCoo, tri.verts);
+        if (!TestFrag(frag, tile)) continue;
+
+        barCoo[0][lane] = frag.barCoo.x;
+        barCoo[1][lane] = frag.barCoo.y;
+        barCoo[2][lane] = frag.barCoo.z;
+        pass |= 1 << lane;
+    }
+    return pass | covered << BLOCK_LANES;
+}
 
-            frag.verts = verts;
-            frag.screenPos = fragScreenPos;
-            frag.barCoo = NdcVertBarCoo(screenBarCoo, verts);
+// adds the block's covered lanes at pixel (x, y) to the heatmap's depth tests
+void CountDepthTests(TileBuffer& tile, int x, int y, int covered) {
+    for (int lane = 0; covered; lane++, covered >>= 1) {
+        if (covered & 1) tile.depthTests[x + lane % BLOCK_WIDTH + (y + lane / BLOCK_WIDTH) * tile.depthTestsWidth]++;
+    }
+}
 
-            if (!TestFrag(frag, zBuffer, data)) continue;
-            FragShader(frag, data, frameBuffer);
+// second phase of visibility buffer mode: the fragment shader runs once for every covered pixel of the tile
+template <class Shader>
+void ShadeVisibilityBuffer(vector<Triangle>& triangles, Data& data, TileBuffer& tile) {
+    Frag frag;
+    bool derivatives = HasVarying(Shader::varyings, VaryingUV) && data.textureFilter == TextureFilter::Trilinear;
+    // walk screen-aligned 2x2 quads, pixels of a quad from the same triangle share its uv derivatives
+    for (int qy = tile.y0 & ~1; qy < tile.y1; qy += 2) {
+        for (int qx = tile.x0 & ~1; qx < tile.x1; qx += 2) {
+            int quadTriangle = -1;
+            for (int i = 0; i < 4; i++) {
+                int x = qx + (i & 1), y = qy + (i >> 1);
+                if (!tile.contains(x, y)) continue;
+                auto index = tile.index(x, y);
+                auto id = tile.triangleIds[index];
+                if (id < 0) continue;
+
+                frag.tri = &triangles[id];
+                frag.verts = triangles[id].verts;
+                frag.screenPos = Vector2Int(x, y);
+                frag.barCoo = tile.barCoos[index];
+                if (derivatives && id != quadTriangle) {
+                    QuadUVDerivatives(triangles[id], qx, qy, frag.uvDx, frag.uvDy);
+                    quadTriangle = id;
+                }
+                ShadeFrag<Shader>(frag, data, tile);
+            }
         }
     }
 }
 
+// coarse uv derivatives of the 2x2 quad at (x, y). The barycentrics come straight from the edge functions,
+// so quad pixels outside the triangle still give the uv the triangle's plane has there.
+void QuadUVDerivatives(Triangle& tri, int x, int y, Vector2& dUVdx, Vector2& dUVdy) {
+    auto& setup = tri.setup;
+    int px[3] = { x, x + 1, x };
+    int py[3] = { y, y, y + 1 };
+    Vector2 uv[3];
+    for (int i = 0; i < 3; i++) {
+        auto screenBarCoo = Vector3(setup.edges[0].At(px[i], py[i]) * setup.invArea,
+            setup.edges[1].At(px[i], py[i]) * setup.invArea, setup.edges[2].At(px[i], py[i]) * setup.invArea);
+        auto barCoo = NdcVertBarCoo(screenBarCoo, tri.verts);
+        uv[i] = Lerp(barCoo, tri.verts[0].uv, tri.verts[1].uv, tri.verts[2].uv);
+    }
+    dUVdx = uv[1] - uv[0];
+    dUVdy = uv[2] - uv[0];
+}
+
 Vector3 NdcVertBarCoo(Vector3& screenBarCoo, Vertex verts[]) {
     auto& ret = Vector3(screenBarCoo.x / verts[0].homScreenPos.w, screenBarCoo.y / verts[1].homScreenPos.w,
         screenBarCoo.z / verts[2].homScreenPos.w);
@@ -242,33 +1734,61 @@ Vector3 NdcVertBarCoo(Vector3& screenBarCoo, Vertex verts[]) {
     return ret;
 }
 
-bool TestFrag(Frag& frag, float zBuffer[], Data& data) {
-    // ü
-    if (frag.screenPos.x < 0 || frag.screenPos.x >= data.width() || frag.screenPos.y < 0 || frag.screenPos.y >= data.height())
-        return false;
-
+bool TestFrag(Frag& frag, TileBuffer& tile, int sample) {
     // Ϸ
     // if (frag.barCoo.x < 0 || frag.barCoo.x > 1 || frag.barCoo.y < 0 || frag.barCoo.y > 1 ||frag.barCoo.z < 0 || frag.barCoo.z > 1) 
     //     return false;
 
     // Ȳ
-    auto index = frag.screenPos.x + frag.screenPos.y * data.width();
-    if (index >= data.length || index < 0) return false;
+    auto index = tile.index(frag.screenPos.x, frag.screenPos.y) * tile.samples + sample;
     auto depth = Lerp(frag.barCoo, frag.verts[0].ndcPos.z, frag.verts[1].ndcPos.z, frag.verts[2].ndcPos.z);
-    if (zBuffer[index] >= depth) return false;
-    zBuffer[index] = depth;
+    if (tile.zBuffer[index] >= depth) return false;
+    tile.zBuffer[index] = depth;
     return true;
 }
 
+template <class Shader>
+void ShadeFrag(Frag& frag, Data& data, TileBuffer& tile, int sampleMask) {
+    COUNT_STAT(tile.counters.fragmentsShaded++);
+    InterpolateVaryings<Shader::varyings>(frag);
+    auto color = Shader::ShadeFragment(frag, data);
+    // the frag passed the tile's coverage test, so the store needs no bounds check
+    int x = frag.screenPos.x - tile.ox, y = frag.screenPos.y - tile.oy;
+    if (tile.samples == 1) {
+        tile.target.store(x, y, color);
+        return;
+    }
+    for (int s = 0; sampleMask; s++, sampleMask >>= 1) {
+        if (sampleMask & 1) tile.target.store(x * tile.samples + s, y, color);
+    }
+}
+
+template <int Varyings>
+void InterpolateVaryings(Frag& frag) {
+    auto& b = frag.barCoo;
+    auto v = frag.verts;
+    if constexpr (HasVarying(Varyings, VaryingUV)) frag.uv = Lerp(b, v[0].uv, v[1].uv, v[2].uv);
+    if constexpr (HasVarying(Varyings, VaryingViewPos)) frag.viewPos = Lerp(b, v[0].viewPos, v[1].viewPos, v[2].viewPos);
+    if constexpr (HasVarying(Varyings, VaryingWorldPos)) frag.worldPos = Lerp(b, v[0].worldPos, v[1].worldPos, v[2].worldPos);
+    if constexpr (HasVarying(Varyings, VaryingNormal)) frag.normal = Lerp(b, v[0].normal, v[1].normal, v[2].normal);
+    if constexpr (HasVarying(Varyings, VaryingTangent)) frag.tangent = Lerp(b, v[0].tangent, v[1].tangent, v[2].tangent);
+}
+
+template <NormalSource Source>
+void BlinnPhongShader<Source>::ShadeVertices(Data& data, int vertBegin, int vertEnd, VertexBuffer& vb, VertexGather& gather) {
+    VertexShader<varyings>(data, vertBegin, vertEnd, vb, gather);
+}
+
 // Ƭɫ
-void FragShader(Frag& frag, Data& data, TGAImage& frameBuffer) {
+template <NormalSource Source>
+ColorF BlinnPhongShader<Source>::ShadeFragment(Frag& frag, Data& data) {
     // prepare
-    auto& fragViewPos = Lerp(frag.barCoo, frag.verts[0].viewPos, frag.verts[1].viewPos, frag.verts[2].viewPos);
-    frag.uv = Lerp(frag.barCoo, frag.verts[0].uv, frag.verts[1].uv, frag.verts[2].uv);
+    auto& fragViewPos = frag.viewPos;
+    auto sampler = FragSampler(frag, data);
 
-    auto& mapColor = data.model.diffuseMap(frag.uv);
-    auto mapSpecPower = data.model.specularMap(frag.uv);
-    auto& normal = CalNormalWithNormalMap(frag, data);
+    auto& mapColor = data.model->diffuseMap(frag.uv, sampler);
+    auto mapSpecPower = data.model->specularMap(frag.uv, sampler);
+    auto& normal = CalNormal<Source>(frag, data, sampler);
     auto& vertToLight = (data.lightViewPos - fragViewPos).Normalized();
     auto distanceToLight = (data.lightViewPos - fragViewPos).Magnitude();
     auto& pointToCam = (data.camViewPos() - fragViewPos).Normalized();
@@ -281,89 +1801,42 @@ void FragShader(Frag& frag, Data& data, TGAImage& frameBuffer) {
     auto p = data.specularBasePower + mapSpecPower;
     auto specular = data.specularK * data.lightIntensity / distanceToLight * pow(specularAffectByNormal, p);
 
-    auto& color = mapColor * (diffuse + specular) + data.ambient;
-    color.a() = 255;
-    frameBuffer.set(frag.screenPos.x, frag.screenPos.y, color);
+    // without a tonemap the light saturates at the map color; with one, highlights above 1 are left to the resolve
+    auto intensity = diffuse + specular;
+    if (data.tonemap == Tonemap::Clamp) intensity = min(intensity, 1.f);
+    auto color = ToColorF(mapColor) * intensity + ToColorF(data.ambient);
+    color.a = 1;
+    return color;
 }
 
-Vector3 CalNormalWithNormalMap(Frag& frag, Data& data) {
-    if (!data.isTangentSpaceNormalMap) {
-        // ʹģͿռ䷨ͼ
-        auto& localNormal = data.model.normalMap(frag.uv).Normalized();
-        return TranslateDir(data.viewMat * data.modelMat, localNormal);
+TextureSampler FragSampler(Frag& frag, Data& data) {
+    TextureSampler sampler;
+    sampler.filter = data.textureFilter;
+    sampler.maxAnisotropy = data.maxAnisotropy;
+    if (data.textureFilter == TextureFilter::Trilinear) {
+        sampler.dUVdx = frag.uvDx;
+        sampler.dUVdy = frag.uvDy;
     }
+    return sampler;
+}
 
-    auto& p0 = frag.verts[0];
-    auto& p1 = frag.verts[1];
-    auto& p2 = frag.verts[2];
-    auto& N = Lerp(frag.barCoo, p0.normal, p1.normal, p2.normal).Normalized();
-
-    // return N;
-    Vector3 T, B;
-    GetTB(p0, p1, p2, N, T, B);
-    // GetTB2(p0, p1, p2, N, out var T, out var B);
-
-    float mDat[4][4]{
-            {T.x,B.x,N.x,0},
-            {T.y,B.y,N.y,0},
-            {T.z,B.z,N.z,0},
-            {0,0,0,1},
-    };
-    auto& M = Matrix4x4(mDat);
-
-    auto& mapNormal = data.model.normalMap(frag.uv).Normalized();
-    auto& normal = TranslateDir(M, mapNormal);
-    return normal;
-}
-
-/* TBN ʽ
-    // triangleƽķ (position delta, )
-    CELL::float3  deltaPos1 = v1 - v0;
-    CELL::float3  deltaPos2 = v2 - v0;
-    // UVƽ (uv delta, )
-    CELL::float2 deltaUV1   = uv1 - uv0;
-    CELL::float2 deltaUV2   = uv2 - uv0;
-
-    float   r  = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x);  // uv
-    CELL::float3 tangent    = (deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y)*r; // ó
-    CELL::float3 binormal   = (deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x)*r; // ó
-
-*/
-static void GetTB(Vertex& p0, Vertex& p1, Vertex& p2, Vector3& N, Vector3& T, Vector3& B) {
-    auto& deltaPos1 = p1.viewPos - p0.viewPos;
-    auto& deltaPos2 = p2.viewPos - p0.viewPos;
-    auto& deltaUV1 = p1.uv - p0.uv;
-    auto& deltaUV2 = p2.uv - p0.uv;
-
-    auto den = 1.f / (deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x);
-    T = ((deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y) * den).Normalized();
-    B = ((deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x) * den).Normalized();
-    // B = (Vector3.Cross(T,N)).normalized;
-}
-
-/* TBN ʽ
-mat<3, 3> AI = mat<3, 3>{ {ndc_tri.col(1) - ndc_tri.col(0), ndc_tri.col(2) - ndc_tri.col(0), bn} }.invert();
-vec3 i = AI * vec3(varying_uv[0][1] - varying_uv[0][0], varying_uv[0][2] - varying_uv[0][0], 0);
-vec3 j = AI * vec3(varying_uv[1][1] - varying_uv[1][0], varying_uv[1][2] - varying_uv[1][0], 0);
-mat<3, 3> B = mat<3, 3>{ {i.normalize(), j.normalize(), bn} }.transpose();
- */
-static void GetTB2(Vertex& p0, Vertex& p1, Vertex& p2, Vector3& N, Vector3& T, Vector3& B) {
-    auto& E1 = p1.viewPos - p0.viewPos;
-    auto& E2 = p2.viewPos - p0.viewPos;
-    auto deltaU1 = p1.uv.x - p0.uv.x;
-    auto deltaU2 = p2.uv.x - p0.uv.x;
-    auto deltaV1 = p1.uv.y - p0.uv.y;
-    auto deltaV2 = p2.uv.y - p0.uv.y;
-    float AIData[4][4]{
-        {E1.x,E1.y,E1.z,0},
-        {E2.x,E2.y,E2.z,0},
-        {N.x,N.y,N.z,0},
-        {0,0,0,1}
-    };
-    auto& AI = Matrix4x4(AIData).Inverse();
-    T = TranslateDir(AI, Vector3(deltaU1, deltaU2, 0));
-    B = TranslateDir(AI, Vector3(deltaV1, deltaV2, 0));
-    // B = Vector3.Cross(N, T);
+template <NormalSource Source>
+Vector3 CalNormal(Frag& frag, Data& data, const TextureSampler& sampler) {
+    if constexpr (Source == NormalSource::Vertex) {
+        return frag.normal.Normalized();
+    }
+    else if constexpr (Source == NormalSource::ObjectSpaceMap) {
+        // ʹģͿռ䷨ͼ
+        return data.mvAffine.TransformDir(data.model->normalMap(frag.uv, sampler)).Normalized();
+    }
+    else {
+        // interpolated tangent frame, the tangent made orthogonal to the normal again
+        auto mapNormal = data.model->normalMap(frag.uv, sampler);
+        auto N = frag.normal.Normalized();
+        auto T = (frag.tangent - Vector3::Dot(N, frag.tangent) * N).Normalized();
+        auto B = frag.tri->bitangentSign * Vector3::Cross(N, T);
+        return (mapNormal.x * T + mapNormal.y * B + mapNormal.z * N).Normalized();
+    }
 }
 
 #pragma endregion
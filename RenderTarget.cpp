@@ -0,0 +1,146 @@
+#include "RenderTarget.h"
+
+// pixels of an RGBA16F row converted to float at once by resolve, a multiple of resolveRow's four per step
+#define RESOLVE_HALF_BLOCK 64
+
+static int pixelBytes(PixelFormat format)
+{
+	return format == PixelFormat::RGBA32F ? 16 : format == PixelFormat::RGBA16F ? 8 : 4;
+}
+
+RenderTarget::RenderTarget() : RenderTarget(0, 0, PixelFormat::RGBA8)
+{
+}
+
+RenderTarget::RenderTarget(int width, int height, PixelFormat format) : w(width), h(height), pixelFormat(format)
+{
+	pixelSize = pixelBytes(format);
+	rowPitch = ((size_t)width * pixelSize + sizeof(CacheLine) - 1) / sizeof(CacheLine) * sizeof(CacheLine);
+	lines.resize(rowPitch / sizeof(CacheLine) * height);
+	clear();
+}
+
+ColorF RenderTarget::load(int x, int y) const
+{
+	auto p = row(y) + x * pixelSize;
+	if (pixelFormat == PixelFormat::RGBA32F) {
+		float v[4];
+		memcpy(v, p, sizeof(v));
+		return ColorF(v[2], v[1], v[0], v[3]);
+	}
+	if (pixelFormat == PixelFormat::RGBA16F) {
+		uint16_t v[4];
+		memcpy(v, p, sizeof(v));
+		return ColorF(HalfToFloat(v[2]), HalfToFloat(v[1]), HalfToFloat(v[0]), HalfToFloat(v[3]));
+	}
+	const float scale = 1.f / 255;
+	return ColorF(p[2] * scale, p[1] * scale, p[0] * scale, p[3] * scale);
+}
+
+void RenderTarget::clear()
+{
+	if (!lines.empty()) memset(lines.data(), 0, lines.size() * sizeof(CacheLine));
+}
+
+void RenderTarget::clearRect(int x, int y, int w, int h)
+{
+	for (int i = 0; i < h; i++) memset(row(y + i) + x * pixelSize, 0, (size_t)w * pixelSize);
+}
+
+void RenderTarget::copyRect(const RenderTarget& src, int srcX, int srcY, int x, int y, int w, int h)
+{
+	for (int i = 0; i < h; i++) {
+		memcpy(row(y + i) + x * pixelSize, src.row(srcY + i) + srcX * pixelSize, (size_t)w * pixelSize);
+	}
+}
+
+// tonemap of one float channel, the scalar version of the vector resolve below
+static float tonemapChannel(float v, Tonemap tonemap)
+{
+	if (tonemap == Tonemap::Reinhard) return v / (1 + v);
+	if (tonemap == Tonemap::ACES) return v * (2.51f * v + 0.03f) / (v * (2.43f * v + 0.59f) + 0.14f);
+	return v;
+}
+
+static uint8_t resolveChannel(float v)
+{
+	return (uint8_t)(min(1.f, max(0.f, v)) * 255 + 0.5f);
+}
+
+#if MATH_SIMD
+// one pixel in b g r a floats: rgb exposed and tonemapped, alpha as it is, then scaled to 0-255
+static inline __m128 resolvePixel(__m128 v, __m128 exposure, __m128 alphaMask, Tonemap tonemap)
+{
+	__m128 c = _mm_mul_ps(v, exposure);
+	__m128 one = _mm_set1_ps(1);
+	if (tonemap == Tonemap::Reinhard) {
+		c = _mm_div_ps(c, _mm_add_ps(one, c));
+	}
+	else if (tonemap == Tonemap::ACES) {
+		__m128 num = _mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), c), _mm_set1_ps(0.03f)));
+		__m128 den = _mm_add_ps(_mm_mul_ps(c, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), c), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+		c = _mm_div_ps(num, den);
+	}
+	c = _mm_or_ps(_mm_andnot_ps(alphaMask, c), _mm_and_ps(alphaMask, v));
+	// max first, so nan becomes 0
+	c = _mm_min_ps(_mm_max_ps(c, _mm_setzero_ps()), one);
+	return _mm_add_ps(_mm_mul_ps(c, _mm_set1_ps(255)), _mm_set1_ps(0.5f));
+}
+#endif
+
+// a row of b g r a floats to 8 bit, four pixels per step
+static void resolveRow(const float* src, uint8_t* dst, int count, Tonemap tonemap, float exposure)
+{
+	int x = 0;
+#if MATH_SIMD
+	__m128 e = _mm_set_ps(1, exposure, exposure, exposure);
+	__m128 alphaMask = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+	for (; x + 4 <= count; x += 4) {
+		const float* p = src + x * 4;
+		__m128i c0 = _mm_cvttps_epi32(resolvePixel(_mm_loadu_ps(p), e, alphaMask, tonemap));
+		__m128i c1 = _mm_cvttps_epi32(resolvePixel(_mm_loadu_ps(p + 4), e, alphaMask, tonemap));
+		__m128i c2 = _mm_cvttps_epi32(resolvePixel(_mm_loadu_ps(p + 8), e, alphaMask, tonemap));
+		__m128i c3 = _mm_cvttps_epi32(resolvePixel(_mm_loadu_ps(p + 12), e, alphaMask, tonemap));
+		__m128i packed = _mm_packus_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, c3));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 4), packed);
+	}
+#endif
+	for (; x < count; x++) {
+		const float* p = src + x * 4;
+		for (int c = 0; c < 3; c++) dst[x * 4 + c] = resolveChannel(tonemapChannel(p[c] * exposure, tonemap));
+		dst[x * 4 + 3] = resolveChannel(p[3]);
+	}
+}
+
+TGAImage RenderTarget::resolve(Tonemap tonemap, float exposure) const
+{
+	TGAImage img(w, h, Format::RGBA);
+	resolve(img, tonemap, exposure);
+	return img;
+}
+
+void RenderTarget::resolve(TGAImage& img, Tonemap tonemap, float exposure) const
+{
+	if (img.get_width() != w || img.get_height() != h || img.get_bytespp() != Format::RGBA) img = TGAImage(w, h, Format::RGBA);
+	size_t stride = (size_t)w * Format::RGBA;
+	for (int y = 0; y < h; y++) {
+		auto dst = img.buffer() + y * stride;
+		if (pixelFormat == PixelFormat::RGBA8) {
+			// clamped when stored, nothing left to map
+			memcpy(dst, row(y), stride);
+			continue;
+		}
+		if (pixelFormat == PixelFormat::RGBA16F) {
+			// widened a block at a time into a buffer on the stack
+			auto half = reinterpret_cast<const uint16_t*>(row(y));
+			float block[RESOLVE_HALF_BLOCK * 4];
+			for (int x = 0; x < w; x += RESOLVE_HALF_BLOCK) {
+				int count = min(w - x, RESOLVE_HALF_BLOCK);
+				for (int i = 0; i < count * 4; i++) block[i] = HalfToFloat(half[x * 4 + i]);
+				resolveRow(block, dst + x * 4, count, tonemap, exposure);
+			}
+			continue;
+		}
+		resolveRow(reinterpret_cast<const float*>(row(y)), dst, w, tonemap, exposure);
+	}
+}
@@ -0,0 +1,128 @@
+#pragma once
+#include "tgaimage.h"
+#include "MathUtil.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+// storage of a render target's pixels, channels in b g r a order like Color32
+enum class PixelFormat { RGBA8, RGBA16F, RGBA32F };
+// how float colors are brought into [0, 1] when a target is resolved to 8 bit; alpha is only clamped
+enum class Tonemap { Clamp, Reinhard, ACES };
+
+// linear float color, 1 is full intensity. Nothing is clamped until the color is stored or resolved.
+struct ColorF {
+	float r, g, b, a;
+
+	ColorF() {}
+	ColorF(float r, float g, float b, float a = 1) :r(r), g(g), b(b), a(a) {}
+};
+inline ColorF operator +(const ColorF& x, const ColorF& y) { return ColorF(x.r + y.r, x.g + y.g, x.b + y.b, x.a + y.a); }
+inline ColorF operator *(const ColorF& x, float s) { return ColorF(x.r * s, x.g * s, x.b * s, x.a * s); }
+inline ColorF operator *(const ColorF& x, const ColorF& y) { return ColorF(x.r * y.r, x.g * y.g, x.b * y.b, x.a * y.a); }
+
+inline ColorF ToColorF(const Color32& c) {
+	const float scale = 1.f / 255;
+	return ColorF(c.bgra[2] * scale, c.bgra[1] * scale, c.bgra[0] * scale, c.bgra[3] * scale);
+}
+
+// IEEE half precision, rounded to nearest even; out of range values become infinity
+inline uint16_t FloatToHalf(float f) {
+	uint32_t x;
+	memcpy(&x, &f, 4);
+	uint32_t sign = (x >> 16) & 0x8000;
+	uint32_t bits = x & 0x7FFFFFFF;
+	if (bits >= 0x47800000) return (uint16_t)(sign | (bits > 0x7F800000 ? 0x7E00 : 0x7C00));
+	if (bits < 0x38800000) {
+		// subnormal: a multiple of 2^-24
+		float a;
+		memcpy(&a, &bits, 4);
+		return (uint16_t)(sign | (uint32_t)lrintf(a * 16777216.f));
+	}
+	uint32_t h = (bits - 0x38000000) >> 13;
+	uint32_t rest = bits & 0x1FFF;
+	h += rest > 0x1000 || (rest == 0x1000 && (h & 1));
+	return (uint16_t)(sign | h);
+}
+
+inline float HalfToFloat(uint16_t h) {
+	uint32_t exponent = (h >> 10) & 0x1F, mantissa = h & 0x3FF;
+	uint32_t x;
+	if (exponent == 0) {
+		float f = mantissa * (1.f / 16777216);
+		memcpy(&x, &f, 4);
+	}
+	else if (exponent == 31) x = 0x7F800000 | (mantissa << 13);
+	else x = ((exponent + 112) << 23) | (mantissa << 13);
+	x |= (uint32_t)(h & 0x8000) << 16;
+	float f;
+	memcpy(&f, &x, 4);
+	return f;
+}
+
+// Color buffer the rasterizer writes into. Rows start on 64 byte boundaries; load and store do no bounds
+// checks, the raster loops only reach pixels inside the target. RGBA8 clamps each store to [0, 1],
+// the float formats keep the full range until resolve.
+class RenderTarget {
+public:
+	RenderTarget();
+	RenderTarget(int width, int height, PixelFormat format);
+
+	int width() const { return w; }
+	int height() const { return h; }
+	PixelFormat format() const { return pixelFormat; }
+	int bytesPerPixel() const { return pixelSize; }
+	size_t pitch() const { return rowPitch; }
+
+	uint8_t* row(int y) { return reinterpret_cast<uint8_t*>(lines.data()) + y * rowPitch; }
+	const uint8_t* row(int y) const { return reinterpret_cast<const uint8_t*>(lines.data()) + y * rowPitch; }
+
+	void store(int x, int y, const ColorF& c) {
+		uint8_t* p = row(y) + x * pixelSize;
+		if (pixelFormat == PixelFormat::RGBA32F) {
+			float v[4] = { c.b, c.g, c.r, c.a };
+			memcpy(p, v, sizeof(v));
+		}
+		else if (pixelFormat == PixelFormat::RGBA16F) {
+			uint16_t v[4] = { FloatToHalf(c.b), FloatToHalf(c.g), FloatToHalf(c.r), FloatToHalf(c.a) };
+			memcpy(p, v, sizeof(v));
+		}
+		else {
+			p[0] = toUnorm8(c.b);
+			p[1] = toUnorm8(c.g);
+			p[2] = toUnorm8(c.r);
+			p[3] = toUnorm8(c.a);
+		}
+	}
+	ColorF load(int x, int y) const;
+
+	// every pixel to 0
+	void clear();
+	// the pixels of a w x h rect at (x, y) to 0
+	void clearRect(int x, int y, int w, int h);
+	// copies a w x h rect of src at (srcX, srcY) to (x, y); both targets have the same format
+	void copyRect(const RenderTarget& src, int srcX, int srcY, int x, int y, int w, int h);
+	// 8 bit RGBA image of the target in one pass, exposure scales rgb before the tonemap
+	TGAImage resolve(Tonemap tonemap = Tonemap::Clamp, float exposure = 1) const;
+	// the same into img, which keeps its storage when it already has the target's size and is RGBA
+	void resolve(TGAImage& img, Tonemap tonemap = Tonemap::Clamp, float exposure = 1) const;
+
+private:
+	struct alignas(64) CacheLine {
+		uint8_t bytes[64];
+	};
+
+	static uint8_t toUnorm8(float v) {
+		// nan ends up at 0
+		return (uint8_t)(min(1.f, max(0.f, v)) * 255 + 0.5f);
+	}
+
+	int w, h;
+	PixelFormat pixelFormat;
+	int pixelSize;
+	size_t rowPitch;
+	vector<CacheLine> lines;
+};
@@ -0,0 +1,207 @@
+#include "MathUtil.h"
+#include "GLUtil.hpp"
+#include "Model.h"
+#include <algorithm>
+#include <cfloat>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+#pragma once
+
+// instances per leaf of a Scene's hierarchy
+#define BVH_LEAF_SIZE 4
+
+class BoundingSphere {
+public :
+    Vector3 center;
+    float radius;
+};
+
+// world-space view frustum, see ViewFrustum: p is inside when Dot(plane, (p, 1)) >= 0 for all six planes.
+// The planes are normalized, so the dot product is the distance to the plane.
+class Frustum {
+public :
+    Vector4 planes[6];
+};
+
+// one placement of a model in a Scene, transformed like Data's model. Instances of one model share its mesh and textures.
+class MeshInstance {
+public :
+    shared_ptr<const Model> model;
+    Vector3 pos = Vector3::Zero();
+    Vector3 rot = Vector3::Zero();
+    Vector3 scale = Vector3(1, 1, 1);
+    BoundingSphere bounds; // world space, set by Scene::Build
+};
+
+// box around the world bounds of its instances. A leaf holds Scene::order[first, first + count),
+// an inner node has count 0 and its children at nodes[first] and nodes[first + 1].
+class BvhNode {
+public :
+    Vector3 boxMin, boxMax;
+    int first;
+    int count;
+};
+
+// mesh instances drawn into one frame, see RenderFrame. A bounding volume hierarchy over their world bounds
+// rejects whole groups of instances outside the view before any of their vertices is transformed.
+class Scene {
+public :
+    vector<MeshInstance> instances;
+
+    // index of the new instance
+    int Add(shared_ptr<const Model> model, const Vector3& pos, const Vector3& rot = Vector3::Zero(),
+        const Vector3& scale = Vector3(1, 1, 1));
+    // world bounds of every instance and the hierarchy over them; again after instances are added, moved or removed
+    void Build();
+    // indices of the instances whose bounds touch the frustum, ascending
+    void Cull(const Frustum& frustum, vector<int>& visible) const;
+
+private :
+    void BuildNode(int node, int first, int count);
+
+    vector<BvhNode> nodes; // the root first
+    vector<int> order;     // instance indices, the ones of each leaf next to each other
+    map<shared_ptr<const Model>, BoundingSphere> modelBounds; // model space, of the models in use at the last Build
+};
+
+// sphere around the center of the model's bounding box
+BoundingSphere ModelBounds(const Model& model) {
+    if (model.verts.empty()) return { Vector3::Zero(), 0 };
+    Vector3 lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (auto& p : model.verts) {
+        lo = Vector3(min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z));
+        hi = Vector3(max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z));
+    }
+    BoundingSphere sphere = { 0.5f * (lo + hi), 0 };
+    for (auto& p : model.verts) sphere.radius = max(sphere.radius, (p - sphere.center).Magnitude());
+    return sphere;
+}
+
+int Scene::Add(shared_ptr<const Model> model, const Vector3& pos, const Vector3& rot, const Vector3& scale) {
+    MeshInstance instance;
+    instance.model = model;
+    instance.pos = pos;
+    instance.rot = rot;
+    instance.scale = scale;
+    instances.push_back(instance);
+    return (int)instances.size() - 1;
+}
+
+void Scene::Build() {
+    // each model's bounds are computed once, while some instance uses it
+    map<shared_ptr<const Model>, BoundingSphere> bounds;
+    for (auto& instance : instances) {
+        auto it = bounds.find(instance.model);
+        if (it == bounds.end()) {
+            auto last = modelBounds.find(instance.model);
+            it = bounds.emplace(instance.model, last != modelBounds.end() ? last->second : ModelBounds(*instance.model)).first;
+        }
+        auto mat = ModelMat(instance.pos, instance.rot, instance.scale);
+        // the longest column of a TRS matrix is its largest scale
+        float scale = 0;
+        for (int j = 0; j < 3; j++) scale = max(scale, Vector3(mat.data[0][j], mat.data[1][j], mat.data[2][j]).Magnitude());
+        instance.bounds.center = Affine3x4(mat).TransformPoint(it->second.center);
+        instance.bounds.radius = it->second.radius * scale;
+    }
+    modelBounds.swap(bounds);
+
+    int count = (int)instances.size();
+    order.resize(count);
+    iota(order.begin(), order.end(), 0);
+    nodes.clear();
+    if (count == 0) return;
+    nodes.push_back(BvhNode());
+    BuildNode(0, 0, count);
+}
+
+// box of order[first, first + count), split at the median center along the axis the centers spread most on
+void Scene::BuildNode(int node, int first, int count) {
+    Vector3 lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    Vector3 centerLo = lo, centerHi = hi;
+    for (int i = first; i < first + count; i++) {
+        auto& s = instances[order[i]].bounds;
+        auto& c = s.center;
+        lo = Vector3(min(lo.x, c.x - s.radius), min(lo.y, c.y - s.radius), min(lo.z, c.z - s.radius));
+        hi = Vector3(max(hi.x, c.x + s.radius), max(hi.y, c.y + s.radius), max(hi.z, c.z + s.radius));
+        centerLo = Vector3(min(centerLo.x, c.x), min(centerLo.y, c.y), min(centerLo.z, c.z));
+        centerHi = Vector3(max(centerHi.x, c.x), max(centerHi.y, c.y), max(centerHi.z, c.z));
+    }
+    nodes[node].boxMin = lo;
+    nodes[node].boxMax = hi;
+    if (count <= BVH_LEAF_SIZE) {
+        nodes[node].first = first;
+        nodes[node].count = count;
+        return;
+    }
+
+    auto spread = centerHi - centerLo;
+    int axis = spread.x >= spread.y && spread.x >= spread.z ? 0 : spread.y >= spread.z ? 1 : 2;
+    auto key = [&](int i) {
+        auto& c = instances[i].bounds.center;
+        return axis == 0 ? c.x : axis == 1 ? c.y : c.z;
+    };
+    int half = count / 2;
+    nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+        [&](int a, int b) { return key(a) < key(b); });
+
+    int left = (int)nodes.size();
+    nodes[node].first = left;
+    nodes[node].count = 0;
+    nodes.push_back(BvhNode());
+    nodes.push_back(BvhNode());
+    BuildNode(left, first, half);
+    BuildNode(left + 1, first + half, count - half);
+}
+
+void Scene::Cull(const Frustum& frustum, vector<int>& visible) const {
+    visible.clear();
+    if (nodes.empty()) return;
+
+    // nodes to visit and the planes their parent's box crosses; the subtree is inside the others.
+    // Splits halve the instances, so the depth stays far below the stack size.
+    int stackNodes[64], stackPlanes[64], top = 0;
+    stackNodes[top] = 0;
+    stackPlanes[top++] = 0x3F;
+    while (top > 0) {
+        top--;
+        auto& node = nodes[stackNodes[top]];
+        int planes = stackPlanes[top];
+
+        bool outside = false;
+        for (int p = 0; p < 6 && !outside; p++) {
+            if (!(planes >> p & 1)) continue;
+            auto& plane = frustum.planes[p];
+            // distance of the box corners farthest along and against the plane's normal
+            float along = plane.w, against = plane.w;
+            for (int axis = 0; axis < 3; axis++) {
+                float a = plane[axis] * (&node.boxMin.x)[axis], b = plane[axis] * (&node.boxMax.x)[axis];
+                along += max(a, b);
+                against += min(a, b);
+            }
+            if (along < 0) outside = true;
+            else if (against >= 0) planes &= ~(1 << p);
+        }
+        if (outside) continue;
+
+        if (node.count == 0) {
+            stackNodes[top] = node.first + 1;
+            stackPlanes[top++] = planes;
+            stackNodes[top] = node.first;
+            stackPlanes[top++] = planes;
+            continue;
+        }
+        for (int i = node.first; i < node.first + node.count; i++) {
+            auto& s = instances[order[i]].bounds;
+            bool inside = true;
+            for (int p = 0; p < 6 && inside; p++) {
+                auto& plane = frustum.planes[p];
+                if (planes >> p & 1) inside = Vector3::Dot(plane, s.center) + plane.w >= -s.radius;
+            }
+            if (inside) visible.push_back(order[i]);
+        }
+    }
+    sort(visible.begin(), visible.end());
+}
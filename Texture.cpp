@@ -0,0 +1,253 @@
+#include "Texture.h"
+#include <algorithm>
+#include <math.h>
+
+uint32_t EncodeNormal(Vector3 n)
+{
+	uint32_t packed = 0;
+	float c[3] = { n.x, n.y, n.z };
+	for (int i = 0; i < 3; i++) {
+		int q = (int)lroundf(min(1.f, max(-1.f, c[i])) * 511);
+		packed |= ((uint32_t)q & 0x3FF) << (i * 10);
+	}
+	return packed;
+}
+
+// decoded rgb of a normal map texel, normalized; a degenerate one points along +z
+static Vector3 normalFromColor(uint32_t b, uint32_t g, uint32_t r)
+{
+	Vector3 n(2 * r / 255.f - 1, 2 * g / 255.f - 1, 2 * b / 255.f - 1);
+	float length = n.Magnitude();
+	return length > 0 ? n / length : Vector3(0, 0, 1);
+}
+
+// 1x1 black, what a missing map samples as
+Texture::Texture() : wrapMode(TextureWrap::Repeat), format(TexelFormat::RGBA8)
+{
+	addLevel(1, 1);
+}
+
+Texture::Texture(const TGAImage& img, TextureWrap wrap, TexelFormat texelFormat) : Texture()
+{
+	wrapMode = wrap;
+	format = texelFormat;
+	if (img.get_width() <= 0 || img.get_height() <= 0) return;
+
+	int w = img.get_width();
+	int h = img.get_height();
+	levels.clear();
+	texels.clear();
+	addLevel(w, h);
+
+	// grayscale is spread to rgb, missing alpha is opaque
+	auto src = img.buffer();
+	int bpp = img.get_bytespp();
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++) {
+			auto p = src + (x + y * w) * bpp;
+			uint32_t b = p[0];
+			uint32_t g = bpp == GRAYSCALE ? p[0] : p[1];
+			uint32_t r = bpp == GRAYSCALE ? p[0] : p[2];
+			uint32_t a = bpp == RGBA ? p[3] : 255;
+			setTexel(x, y, 0, format == TexelFormat::Normal ? EncodeNormal(normalFromColor(b, g, r)) : b | g << 8 | r << 16 | a << 24);
+		}
+	}
+
+	// mip chain: each texel is the box filtered average of its 2x2 parent texels, odd edges are clamped.
+	// Normals are averaged as vectors and renormalized.
+	for (int level = 1; w > 1 || h > 1; level++) {
+		int pw = w, ph = h;
+		w = max(1, w / 2);
+		h = max(1, h / 2);
+		addLevel(w, h);
+		for (int y = 0; y < h; y++) {
+			int y0 = min(2 * y, ph - 1), y1 = min(2 * y + 1, ph - 1);
+			for (int x = 0; x < w; x++) {
+				int x0 = min(2 * x, pw - 1), x1 = min(2 * x + 1, pw - 1);
+				uint32_t quad[4] = { texel(x0, y0, level - 1), texel(x1, y0, level - 1), texel(x0, y1, level - 1), texel(x1, y1, level - 1) };
+				uint32_t value = 0;
+				if (format == TexelFormat::Normal) {
+					Vector3 sum(0, 0, 0);
+					for (auto t : quad) sum = sum + DecodeNormal(t);
+					float length = sum.Magnitude();
+					value = EncodeNormal(length > 0 ? sum / length : Vector3(0, 0, 1));
+				}
+				else {
+					for (int c = 0; c < 32; c += 8) {
+						uint32_t sum = 2;
+						for (auto t : quad) sum += (t >> c) & 0xFF;
+						value |= (sum / 4) << c;
+					}
+				}
+				setTexel(x, y, level, value);
+			}
+		}
+	}
+}
+
+void Texture::addLevel(int w, int h)
+{
+	MipLevel l;
+	l.w = w;
+	l.h = h;
+	l.tilesX = (w + 3) / 4;
+	l.offset = texels.size();
+	levels.push_back(l);
+	texels.resize(texels.size() + (size_t)l.tilesX * ((h + 3) / 4) * 16, 0);
+}
+
+void Texture::setTexel(int x, int y, int level, uint32_t value)
+{
+	auto& l = levels[level];
+	texels[l.offset + ((y >> 2) * l.tilesX + (x >> 2)) * 16 + ((x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2))] = value;
+}
+
+// uv into [0, 1], nan and inf end up at 0
+float Texture::wrapU(float u) const
+{
+	float t = wrapMode == TextureWrap::Repeat ? u - floorf(u) : u;
+	return min(1.f, max(0.f, t));
+}
+
+// x is at most one texel outside [0, size)
+int Texture::wrapCoord(int x, int size) const
+{
+	if (wrapMode == TextureWrap::Clamp) return max(0, min(x, size - 1));
+	x += size & (x >> 31);
+	return x - (size & ((size - 1 - x) >> 31));
+}
+
+uint32_t Texture::sampleNearest(float u, float v) const
+{
+	int w = levels[0].w, h = levels[0].h;
+	int x = min((int)(w * wrapU(u)), w - 1);
+	int y = min((int)(h * wrapU(v)), h - 1);
+	return texel(x, y);
+}
+
+// lerp of packed texels, two channels per multiply; f is the weight of b in 1/256
+static inline uint32_t lerpTexel(uint32_t a, uint32_t b, uint32_t f)
+{
+	const uint32_t mask = 0x00FF00FF;
+	uint32_t rb = (((a & mask) * (256 - f) + (b & mask) * f) >> 8) & mask;
+	uint32_t ga = (((a >> 8) & mask) * (256 - f) + ((b >> 8) & mask) * f) & ~mask;
+	return rb | ga;
+}
+
+Texture::BilinearTaps Texture::bilinearTaps(float u, float v, int level) const
+{
+	int w = levels[level].w, h = levels[level].h;
+	// texel centers are at half integers
+	float fu = w * wrapU(u) - 0.5f;
+	float fv = h * wrapU(v) - 0.5f;
+	float fx = floorf(fu), fy = floorf(fv);
+	int x0 = (int)fx, y0 = (int)fy;
+	BilinearTaps taps;
+	taps.ax = fu - fx;
+	taps.ay = fv - fy;
+	taps.x0 = wrapCoord(x0, w);
+	taps.y0 = wrapCoord(y0, h);
+	taps.x1 = wrapCoord(x0 + 1, w);
+	taps.y1 = wrapCoord(y0 + 1, h);
+	return taps;
+}
+
+uint32_t Texture::sampleBilinear(float u, float v, int level) const
+{
+	auto t = bilinearTaps(u, v, level);
+	uint32_t ax = (uint32_t)(t.ax * 256);
+	uint32_t ay = (uint32_t)(t.ay * 256);
+	auto top = lerpTexel(texel(t.x0, t.y0, level), texel(t.x1, t.y0, level), ax);
+	auto bottom = lerpTexel(texel(t.x0, t.y1, level), texel(t.x1, t.y1, level), ax);
+	return lerpTexel(top, bottom, ay);
+}
+
+uint32_t Texture::sampleTrilinear(float u, float v, float lod) const
+{
+	// clamped to the chain, nan picks level 0
+	lod = min((float)(levels.size() - 1), max(0.f, lod));
+	int level = (int)lod;
+	uint32_t f = (uint32_t)((lod - level) * 256);
+	auto fine = sampleBilinear(u, v, level);
+	if (f == 0) return fine;
+	return lerpTexel(fine, sampleBilinear(u, v, level + 1), f);
+}
+
+float Texture::footprintLod(const TextureSampler& sampler, int& count, Vector2& axis) const
+{
+	// footprint axes in texels of the full resolution level
+	float w = (float)levels[0].w, h = (float)levels[0].h;
+	float xu = sampler.dUVdx.x * w, xv = sampler.dUVdx.y * h;
+	float yu = sampler.dUVdy.x * w, yv = sampler.dUVdy.y * h;
+	float lx = xu * xu + xv * xv;
+	float ly = yu * yu + yv * yv;
+	float major = max(lx, ly), minor = min(lx, ly);
+
+	count = 1;
+	if (sampler.maxAnisotropy > 1 && minor > 0) {
+		count = (int)min(ceilf(sqrtf(major / minor)), (float)sampler.maxAnisotropy);
+	}
+	axis = lx >= ly ? sampler.dUVdx : sampler.dUVdy;
+	// log2 of the length of the major axis, shortened by the samples placed along it
+	return 0.5f * log2f(major) - log2f((float)count);
+}
+
+uint32_t Texture::sampleGrad(float u, float v, const TextureSampler& sampler) const
+{
+	int count;
+	Vector2 axis;
+	float lod = footprintLod(sampler, count, axis);
+	if (count == 1) return sampleTrilinear(u, v, lod);
+
+	// average of trilinear samples spread along the major axis
+	uint32_t sum[4] = { 0, 0, 0, 0 };
+	for (int i = 0; i < count; i++) {
+		float t = (i + 0.5f) / count - 0.5f;
+		auto s = sampleTrilinear(u + axis.x * t, v + axis.y * t, lod);
+		for (int c = 0; c < 4; c++) sum[c] += (s >> (c * 8)) & 0xFF;
+	}
+	uint32_t value = 0;
+	for (int c = 0; c < 4; c++) value |= ((sum[c] + count / 2) / count) << (c * 8);
+	return value;
+}
+
+Vector3 Texture::normalBilinear(float u, float v, int level) const
+{
+	auto t = bilinearTaps(u, v, level);
+	auto top = (1 - t.ax) * DecodeNormal(texel(t.x0, t.y0, level)) + t.ax * DecodeNormal(texel(t.x1, t.y0, level));
+	auto bottom = (1 - t.ax) * DecodeNormal(texel(t.x0, t.y1, level)) + t.ax * DecodeNormal(texel(t.x1, t.y1, level));
+	return (1 - t.ay) * top + t.ay * bottom;
+}
+
+Vector3 Texture::normalTrilinear(float u, float v, float lod) const
+{
+	lod = min((float)(levels.size() - 1), max(0.f, lod));
+	int level = (int)lod;
+	float f = lod - level;
+	auto fine = normalBilinear(u, v, level);
+	if (f == 0) return fine;
+	return (1 - f) * fine + f * normalBilinear(u, v, level + 1);
+}
+
+Vector3 Texture::sampleNormal(float u, float v, const TextureSampler& sampler) const
+{
+	// the texels are unit length already, only a blend of them needs normalizing
+	if (sampler.filter == TextureFilter::Nearest) return DecodeNormal(sampleNearest(u, v));
+
+	Vector3 n;
+	if (sampler.filter == TextureFilter::Bilinear) {
+		n = normalBilinear(u, v, 0);
+	}
+	else {
+		int count;
+		Vector2 axis;
+		float lod = footprintLod(sampler, count, axis);
+		n = Vector3(0, 0, 0);
+		for (int i = 0; i < count; i++) {
+			float t = (i + 0.5f) / count - 0.5f;
+			n = n + normalTrilinear(u + axis.x * t, v + axis.y * t, lod);
+		}
+	}
+	float length = n.Magnitude();
+	return length > 0 ? n / length : Vector3(0, 0, 1);
+}
@@ -0,0 +1,104 @@
+#pragma once
+#include "tgaimage.h"
+#include "MathUtil.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+using namespace std;
+
+// texture addressing for uv outside [0, 1)
+enum class TextureWrap { Repeat, Clamp };
+// Nearest and Bilinear read the full resolution level, Trilinear picks mip levels from the uv derivatives
+enum class TextureFilter { Nearest, Bilinear, Trilinear };
+// what the 32 bit texels hold: RGBA8 colors, or unit vectors decoded and normalized once at load, as signed 10 bit xyz
+enum class TexelFormat { RGBA8, Normal };
+
+// packed texel: the bytes of Color32::bgra, b in the low byte
+inline Color32 ToColor32(uint32_t packed) {
+	Color32 c;
+	memcpy(c.bgra, &packed, 4);
+	c.bytespp = 4;
+	return c;
+}
+
+// Normal texels: x in bits 0-9, y in 10-19, z in 20-29, each a two's complement fraction of 511
+inline Vector3 DecodeNormal(uint32_t packed) {
+	const float scale = 1.f / 511;
+	return Vector3((float)((int32_t)(packed << 22) >> 22) * scale,
+		(float)((int32_t)(packed << 12) >> 22) * scale,
+		(float)((int32_t)(packed << 2) >> 22) * scale);
+}
+uint32_t EncodeNormal(Vector3 n);
+
+// how one fragment samples: the filter and the uv derivatives of its 2x2 quad
+struct TextureSampler {
+	TextureFilter filter = TextureFilter::Nearest;
+	int maxAnisotropy = 1;       // > 1 takes up to this many trilinear samples along the long axis of the footprint
+	Vector2 dUVdx = Vector2(0, 0); // uv change to the next pixel in x
+	Vector2 dUVdy = Vector2(0, 0); // and in y
+};
+
+// Texture converted from a TGAImage at load time, with its mip chain down to 1x1.
+// Texels are stored in 4x4 tiles of 64 bytes (one cache line), Morton ordered inside the tile and tiles
+// row-major, so a footprint that spans rows stays in a few cache lines. Sampling returns packed texels,
+// or unit vectors for a Normal texture.
+class Texture {
+public:
+	Texture();
+	// a Normal texture reads the rgb of the image as xyz in [-1, 1]
+	explicit Texture(const TGAImage& img, TextureWrap wrap = TextureWrap::Repeat, TexelFormat format = TexelFormat::RGBA8);
+
+	int width() const { return levels[0].w; }
+	int height() const { return levels[0].h; }
+	int levelCount() const { return (int)levels.size(); }
+	TextureWrap wrap() const { return wrapMode; }
+	TexelFormat texelFormat() const { return format; }
+
+	uint32_t sample(float u, float v, TextureFilter filter) const {
+		return filter == TextureFilter::Bilinear ? sampleBilinear(u, v) : sampleNearest(u, v);
+	}
+	uint32_t sample(float u, float v, const TextureSampler& sampler) const {
+		return sampler.filter == TextureFilter::Trilinear ? sampleGrad(u, v, sampler) : sample(u, v, sampler.filter);
+	}
+	uint32_t sampleNearest(float u, float v) const;
+	uint32_t sampleBilinear(float u, float v, int level = 0) const;
+	// lod 0 is the full resolution level
+	uint32_t sampleTrilinear(float u, float v, float lod) const;
+	// level of detail from the derivatives, anisotropic when the sampler allows it
+	uint32_t sampleGrad(float u, float v, const TextureSampler& sampler) const;
+	// unit vector of a Normal texture, filtered in float and renormalized when more than one texel is read
+	Vector3 sampleNormal(float u, float v, const TextureSampler& sampler) const;
+
+	// texel at integer coordinates already inside the level
+	uint32_t texel(int x, int y, int level = 0) const {
+		auto& l = levels[level];
+		return texels[l.offset + ((y >> 2) * l.tilesX + (x >> 2)) * 16 + ((x & 1) | ((y & 1) << 1) | ((x & 2) << 1) | ((y & 2) << 2))];
+	}
+
+private:
+	struct MipLevel {
+		int w, h;
+		int tilesX;
+		size_t offset; // of the level's first tile in texels
+	};
+	// the 2x2 texels around a uv and the weights of the second column and row
+	struct BilinearTaps {
+		int x0, y0, x1, y1;
+		float ax, ay;
+	};
+
+	void addLevel(int w, int h);
+	void setTexel(int x, int y, int level, uint32_t value);
+	int wrapCoord(int x, int size) const;
+	float wrapU(float u) const;
+	BilinearTaps bilinearTaps(float u, float v, int level) const;
+	float footprintLod(const TextureSampler& sampler, int& count, Vector2& axis) const;
+	Vector3 normalBilinear(float u, float v, int level) const;
+	Vector3 normalTrilinear(float u, float v, float lod) const;
+
+	TextureWrap wrapMode;
+	TexelFormat format;
+	vector<MipLevel> levels;
+	vector<uint32_t> texels;
+};
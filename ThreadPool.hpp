@@ -0,0 +1,98 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <vector>
+
+// Fixed-size worker pool used by the render pipeline.
+// The calling thread takes part in ParallelFor, so a pool of size 1 runs everything inline.
+class ThreadPool {
+public:
+    // threadCount <= 0 uses every hardware thread
+    explicit ThreadPool(int threadCount) {
+        if (threadCount <= 0) threadCount = (int)std::thread::hardware_concurrency();
+        if (threadCount <= 0) threadCount = 1;
+        for (int i = 1; i < threadCount; i++) {
+            workers.emplace_back([this, i] { WorkerLoop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeWorkers.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return (int)workers.size() + 1; }
+
+    // Calls fn(index, workerIndex) for every index in [0, count) and blocks until all calls returned.
+    // workerIndex is in [0, size()) and identifies the thread, so callers can keep per-thread scratch data.
+    void ParallelFor(int count, const std::function<void(int, int)>& fn) {
+        if (count <= 0) return;
+        if (workers.empty() || count == 1) {
+            for (int i = 0; i < count; i++) fn(i, 0);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            jobCount = count;
+            nextIndex = 0;
+            busyWorkers = (int)workers.size();
+            generation++;
+        }
+        wakeWorkers.notify_all();
+        RunJob(fn, count, 0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        jobDone.wait(lock, [this] { return busyWorkers == 0; });
+        job = nullptr;
+    }
+
+private:
+    void RunJob(const std::function<void(int, int)>& fn, int count, int workerIndex) {
+        for (int i = nextIndex++; i < count; i = nextIndex++) {
+            fn(i, workerIndex);
+        }
+    }
+
+    void WorkerLoop(int workerIndex) {
+        unsigned seenGeneration = 0;
+        while (true) {
+            const std::function<void(int, int)>* fn;
+            int count;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeWorkers.wait(lock, [&] { return stopping || generation != seenGeneration; });
+                if (stopping) return;
+                seenGeneration = generation;
+                fn = job;
+                count = jobCount;
+            }
+            RunJob(*fn, count, workerIndex);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--busyWorkers == 0) jobDone.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeWorkers;
+    std::condition_variable jobDone;
+    const std::function<void(int, int)>* job = nullptr;
+    int jobCount = 0;
+    std::atomic<int> nextIndex{ 0 };
+    int busyWorkers = 0;
+    unsigned generation = 0;
+    bool stopping = false;
+};
@@ -1,7 +1,11 @@
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <array>
+#include <functional>
+#include <mutex>
 #include "tgaimage.h"
+#include "ThreadPool.hpp"
 
 TGAImage::TGAImage() : data(), width(0), height(0), bytespp(0) {}
 TGAImage::TGAImage(const int w, const int h, const Format format) : data(w* h* (int)format, 0), width(w), height(h), bytespp((int)format) {}
@@ -111,106 +115,387 @@ bool TGAImage::load_rle_data(std::ifstream& in) {
     return true;
 }
 
-bool TGAImage::write_tga_file(const std::string filename, const bool vflip, const bool rle) const {
-    std::uint8_t developer_area_ref[4] = { 0, 0, 0, 0 };
-    std::uint8_t extension_area_ref[4] = { 0, 0, 0, 0 };
-    std::uint8_t footer[18] = { 'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0' };
+#pragma region Writers
+
+typedef std::pair<const void*, size_t> Span;
+
+// the spans are large and go to the os without passing through the stream's buffer
+static bool write_file(const std::string& filename, const std::vector<Span>& spans) {
     std::ofstream out;
     out.open(filename, std::ios::binary);
     if (!out.is_open()) {
         std::cerr << "can't open file " << filename << "\n";
-        out.close();
         return false;
     }
+    for (auto& span : spans) out.write(static_cast<const char*>(span.first), span.second);
+    if (!out.good()) {
+        std::cerr << "can't dump the file " << filename << "\n";
+        return false;
+    }
+    return true;
+}
+
+static bool write_file(const std::string& filename, const std::vector<std::uint8_t>& bytes) {
+    return write_file(filename, { Span(bytes.data(), bytes.size()) });
+}
+
+static void append(std::vector<std::uint8_t>& out, const void* p, const size_t n) {
+    auto bytes = static_cast<const std::uint8_t*>(p);
+    out.insert(out.end(), bytes, bytes + n);
+}
+
+static void append_be32(std::vector<std::uint8_t>& out, const std::uint32_t v) {
+    const std::uint8_t bytes[4] = { (std::uint8_t)(v >> 24), (std::uint8_t)(v >> 16), (std::uint8_t)(v >> 8), (std::uint8_t)v };
+    append(out, bytes, 4);
+}
+
+// images are encoded in strips of at least min_rows rows, one per core
+static int strip_count(const int rows, const int min_rows) {
+    return std::max(1, std::min((int)std::thread::hardware_concurrency(), rows / min_rows));
+}
+
+static int strip_begin(const int strip, const int strips, const int rows) {
+    return (int)((long long)rows * strip / strips);
+}
+
+// encode(strip, first row, end row) for every strip, in parallel. The encoder threads are started by the first
+// write and kept for all later ones; writes from several threads take turns on them.
+static void encode_strips(const int strips, const int rows, const std::function<void(int, int, int)>& encode) {
+    if (strips == 1) {
+        encode(0, 0, rows);
+        return;
+    }
+    static ThreadPool pool(0);
+    static std::mutex pool_mutex;
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    pool.ParallelFor(strips, [&](int i, int) {
+        encode(i, strip_begin(i, strips, rows), strip_begin(i + 1, strips, rows));
+    });
+}
+
+bool TGAImage::write_tga_file(const std::string filename, const bool vflip, const bool rle) const {
+    const std::uint8_t developer_area_ref[4] = { 0, 0, 0, 0 };
+    const std::uint8_t extension_area_ref[4] = { 0, 0, 0, 0 };
+    const std::uint8_t footer[18] = { 'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0' };
     TGA_Header header;
     header.bitsperpixel = bytespp << 3;
     header.width = width;
     header.height = height;
     header.datatypecode = (bytespp == GRAYSCALE ? (rle ? 11 : 3) : (rle ? 10 : 2));
     header.imagedescriptor = vflip ? 0x00 : 0x20; // top-left or bottom-left origin
-    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
-    if (!out.good()) {
-        out.close();
-        std::cerr << "can't dump the tga file\n";
-        return false;
-    }
-    if (!rle) {
-        out.write(reinterpret_cast<const char*>(data.data()), width * height * bytespp);
-        if (!out.good()) {
-            std::cerr << "can't unload raw data\n";
-            out.close();
-            return false;
-        }
+
+    std::vector<Span> spans = { Span(&header, sizeof(header)) };
+    std::vector<std::vector<std::uint8_t>> parts;
+    if (rle) {
+        parts.resize(strip_count(height, 64));
+        encode_strips((int)parts.size(), height, [&](int i, int y0, int y1) { encode_rle_rows(y0, y1, parts[i]); });
+        for (auto& part : parts) spans.push_back(Span(part.data(), part.size()));
     }
     else {
-        if (!unload_rle_data(out)) {
-            out.close();
-            std::cerr << "can't unload rle data\n";
-            return false;
-        }
+        spans.push_back(Span(data.data(), data.size()));
     }
-    out.write(reinterpret_cast<const char*>(developer_area_ref), sizeof(developer_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
+    spans.push_back(Span(developer_area_ref, sizeof(developer_area_ref)));
+    spans.push_back(Span(extension_area_ref, sizeof(extension_area_ref)));
+    spans.push_back(Span(footer, sizeof(footer)));
+    return write_file(filename, spans);
+}
+
+// the pixel size is a template argument so the pixel compares become single loads
+template <int Bpp>
+static void encode_rle_row(const std::uint8_t* row, const int width, std::vector<std::uint8_t>& out) {
+    const int max_chunk_length = 128;
+    auto same = [&](int a, int b) { return memcmp(row + a * Bpp, row + b * Bpp, Bpp) == 0; };
+    int x = 0;
+    while (x < width) {
+        int run = 1;
+        while (x + run < width && run < max_chunk_length && same(x, x + run)) run++;
+        if (run > 1) {
+            out.push_back((std::uint8_t)(run + 127));
+            append(out, row + x * Bpp, Bpp);
+        }
+        else {
+            // raw up to the next pair of equal pixels
+            while (x + run < width && run < max_chunk_length && !(x + run + 1 < width && same(x + run, x + run + 1))) run++;
+            out.push_back((std::uint8_t)(run - 1));
+            append(out, row + x * Bpp, run * Bpp);
+        }
+        x += run;
     }
-    out.write(reinterpret_cast<const char*>(extension_area_ref), sizeof(extension_area_ref));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
+}
+
+// packets stop at the end of each row, so strips of rows encode independently
+void TGAImage::encode_rle_rows(const int y0, const int y1, std::vector<std::uint8_t>& out) const {
+    const size_t row_bytes = (size_t)width * bytespp;
+    out.reserve(out.size() + (y1 - y0) * (row_bytes + width / 128 + 1));
+    for (int y = y0; y < y1; y++) {
+        const std::uint8_t* row = data.data() + y * row_bytes;
+        if (bytespp == RGBA) encode_rle_row<4>(row, width, out);
+        else if (bytespp == RGB) encode_rle_row<3>(row, width, out);
+        else encode_rle_row<1>(row, width, out);
     }
-    out.write(reinterpret_cast<const char*>(footer), sizeof(footer));
-    if (!out.good()) {
-        std::cerr << "can't dump the tga file\n";
-        out.close();
-        return false;
+}
+
+bool TGAImage::write_ppm_file(const std::string filename, const bool vflip) const {
+    const int channels = bytespp == GRAYSCALE ? 1 : 3;
+    std::string header = std::string(channels == 1 ? "P5" : "P6") + "\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+    std::vector<std::uint8_t> out(header.size() + (size_t)width * height * channels);
+    memcpy(out.data(), header.data(), header.size());
+    std::uint8_t* body = out.data() + header.size();
+    encode_strips(strip_count(height, 64), height, [&](int, int y0, int y1) {
+        for (int r = y0; r < y1; r++) {
+            const std::uint8_t* src = data.data() + (size_t)(vflip ? height - 1 - r : r) * width * bytespp;
+            std::uint8_t* dst = body + (size_t)r * width * channels;
+            if (channels == 1) {
+                memcpy(dst, src, width);
+                continue;
+            }
+            for (int x = 0; x < width; x++, src += bytespp, dst += 3) {
+                dst[0] = src[2];
+                dst[1] = src[1];
+                dst[2] = src[0];
+            }
+        }
+    });
+    return write_file(filename, out);
+}
+
+bool TGAImage::write_raw_file(const std::string filename, const bool vflip) const {
+    const size_t row_bytes = (size_t)width * bytespp;
+    std::vector<std::uint8_t> out(data.size());
+    for (int r = 0; r < height; r++) {
+        memcpy(out.data() + r * row_bytes, data.data() + (vflip ? height - 1 - r : r) * row_bytes, row_bytes);
     }
-    out.close();
-    return true;
+    return write_file(filename, out);
 }
 
-// TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream& out) const {
-    const std::uint8_t max_chunk_length = 128;
-    size_t npixels = width * height;
-    size_t curpix = 0;
-    while (curpix < npixels) {
-        size_t chunkstart = curpix * bytespp;
-        size_t curbyte = curpix * bytespp;
-        std::uint8_t run_length = 1;
-        bool raw = true;
-        while (curpix + run_length < npixels && run_length < max_chunk_length) {
-            bool succ_eq = true;
-            for (int t = 0; succ_eq && t < bytespp; t++)
-                succ_eq = (data[curbyte + t] == data[curbyte + t + bytespp]);
-            curbyte += bytespp;
-            if (1 == run_length)
-                raw = !succ_eq;
-            if (raw && succ_eq) {
-                run_length--;
-                break;
+// deflate with the fixed huffman codes of RFC 1951 and a greedy one-probe LZ77 match search: no code tables
+// to build or send, and most of a rendered frame is long runs the matcher finds anyway
+struct DeflateTables {
+    std::uint16_t lit_code[288]; // bit reversed, ready for the lsb-first stream
+    std::uint8_t lit_bits[288];
+    std::uint8_t len_symbol[259];    // match length -> length symbol - 257
+    std::uint8_t dist_symbol_lo[256]; // distance - 1 < 256 -> distance symbol
+    std::uint8_t dist_symbol_hi[256]; // (distance - 1) >> 7 for the longer ones
+    std::uint8_t dist_code[30];
+
+    static constexpr std::uint16_t length_base[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+    static constexpr std::uint8_t length_extra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+    static constexpr std::uint16_t dist_base[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+    static constexpr std::uint8_t dist_extra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+    static std::uint32_t reverse(std::uint32_t code, const int bits) {
+        std::uint32_t r = 0;
+        for (int i = 0; i < bits; i++, code >>= 1) r = (r << 1) | (code & 1);
+        return r;
+    }
+
+    DeflateTables() {
+        for (int s = 0; s < 288; s++) {
+            int bits = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+            int code = s < 144 ? 0x30 + s : s < 256 ? 0x190 + s - 144 : s < 280 ? s - 256 : 0xC0 + s - 280;
+            lit_code[s] = (std::uint16_t)reverse(code, bits);
+            lit_bits[s] = (std::uint8_t)bits;
+        }
+        // 258 has its own symbol, it overwrites the end of 284's range
+        for (int s = 0; s < 29; s++) {
+            for (int len = length_base[s]; len < length_base[s] + (1 << length_extra[s]) && len <= 258; len++) len_symbol[len] = (std::uint8_t)s;
+        }
+        for (int s = 0; s < 30; s++) {
+            dist_code[s] = (std::uint8_t)reverse(s, 5);
+            for (int d = dist_base[s]; d < dist_base[s] + (1 << dist_extra[s]); d++) {
+                if (d <= 256) dist_symbol_lo[d - 1] = (std::uint8_t)s;
+                else dist_symbol_hi[(d - 1) >> 7] = (std::uint8_t)s;
             }
-            if (!raw && !succ_eq)
-                break;
-            run_length++;
         }
-        curpix += run_length;
-        out.put(raw ? run_length - 1 : run_length + 127);
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
+    }
+};
+
+// deflate packs bits from the least significant end
+struct BitWriter {
+    std::vector<std::uint8_t>& out;
+    std::uint64_t bits = 0;
+    int count = 0;
+
+    void put(const std::uint32_t v, const int n) {
+        bits |= (std::uint64_t)v << count;
+        count += n;
+        if (count >= 32) {
+            append_le32((std::uint32_t)bits);
+            bits >>= 32;
+            count -= 32;
         }
-        out.write(reinterpret_cast<const char*>(data.data() + chunkstart), (raw ? run_length * bytespp : bytespp));
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
+    }
+    void flush() {
+        for (; count > 0; count -= 8, bits >>= 8) out.push_back((std::uint8_t)bits);
+        count = 0;
+        bits = 0;
+    }
+
+private:
+    void append_le32(const std::uint32_t v) {
+        const std::uint8_t bytes[4] = { (std::uint8_t)v, (std::uint8_t)(v >> 8), (std::uint8_t)(v >> 16), (std::uint8_t)(v >> 24) };
+        append(out, bytes, 4);
+    }
+};
+
+// one non-final block, closed by an empty stored block so it ends on a byte boundary and
+// the next strip's block can be appended as it is
+static void deflate_fixed(const std::uint8_t* in, const size_t n, std::vector<std::uint8_t>& out) {
+    static const DeflateTables t;
+    const int hash_bits = 15;
+    const size_t window = 32768, max_match = 258;
+    std::vector<std::int32_t> head(1 << hash_bits, -1);
+    out.reserve(out.size() + n / 4 + 64);
+    BitWriter bw{ out };
+    bw.put(2, 3); // not final, fixed huffman
+    size_t i = 0;
+    for (; i + 3 <= n;) {
+        std::uint32_t key = in[i] | in[i + 1] << 8 | in[i + 2] << 16;
+        std::uint32_t h = (key * 2654435761u) >> (32 - hash_bits);
+        std::int32_t candidate = head[h];
+        head[h] = (std::int32_t)i;
+        if (candidate >= 0 && i - candidate <= window && memcmp(in + candidate, in + i, 3) == 0) {
+            size_t limit = std::min(max_match, n - i), len = 3;
+            while (len < limit && in[candidate + len] == in[i + len]) len++;
+            int ls = t.len_symbol[len];
+            bw.put(t.lit_code[257 + ls], t.lit_bits[257 + ls]);
+            if (DeflateTables::length_extra[ls]) bw.put((std::uint32_t)len - DeflateTables::length_base[ls], DeflateTables::length_extra[ls]);
+            std::uint32_t dist = (std::uint32_t)(i - candidate);
+            int ds = dist <= 256 ? t.dist_symbol_lo[dist - 1] : t.dist_symbol_hi[(dist - 1) >> 7];
+            bw.put(t.dist_code[ds], 5);
+            if (DeflateTables::dist_extra[ds]) bw.put(dist - DeflateTables::dist_base[ds], DeflateTables::dist_extra[ds]);
+            i += len;
+        }
+        else {
+            bw.put(t.lit_code[in[i]], t.lit_bits[in[i]]);
+            i++;
         }
     }
-    return true;
+    for (; i < n; i++) bw.put(t.lit_code[in[i]], t.lit_bits[in[i]]);
+    bw.put(t.lit_code[256], t.lit_bits[256]);
+    bw.put(0, 3); // not final, stored
+    bw.flush();
+    const std::uint8_t empty_stored[4] = { 0x00, 0x00, 0xFF, 0xFF };
+    append(out, empty_stored, 4);
+}
+
+static std::uint32_t adler32(const std::uint8_t* p, size_t n) {
+    const std::uint32_t mod = 65521;
+    std::uint32_t a = 1, b = 0;
+    while (n > 0) {
+        // the most bytes before b can overflow
+        size_t k = std::min<size_t>(n, 5552);
+        for (size_t i = 0; i < k; i++) {
+            a += p[i];
+            b += a;
+        }
+        a %= mod;
+        b %= mod;
+        p += k;
+        n -= k;
+    }
+    return b << 16 | a;
 }
 
+// checksum of x's bytes followed by y's, from both checksums and y's length
+static std::uint32_t adler32_combine(const std::uint32_t x, const std::uint32_t y, const size_t y_length) {
+    const std::uint64_t mod = 65521;
+    std::uint64_t a1 = x & 0xFFFF, b1 = x >> 16, a2 = y & 0xFFFF, b2 = y >> 16;
+    std::uint64_t rem = y_length % mod;
+    std::uint64_t a = (a1 + a2 + mod - 1) % mod;
+    std::uint64_t b = (b1 + b2 + rem * a1 % mod + mod - rem) % mod; // b1 + b2 + y_length * (a1 - 1)
+    return (std::uint32_t)(b << 16 | a);
+}
+
+static std::uint32_t crc32(const std::uint8_t* p, const size_t n) {
+    static const auto table = [] {
+        std::array<std::uint32_t, 256> t;
+        for (std::uint32_t i = 0; i < 256; i++) {
+            std::uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    std::uint32_t c = 0xFFFFFFFF;
+    for (size_t i = 0; i < n; i++) c = table[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFF;
+}
+
+// rows [y0, y1) of the picture, top-down, in png channel order, Up filtered and deflated.
+// adler is the checksum of the filtered bytes, the strips' checksums are combined afterwards.
+void TGAImage::encode_png_rows(const int y0, const int y1, const bool vflip, std::vector<std::uint8_t>& out, std::uint32_t& adler) const {
+    const size_t row_bytes = (size_t)width * bytespp;
+    std::vector<std::uint8_t> filtered((row_bytes + 1) * (y1 - y0));
+    std::vector<std::uint8_t> prev(row_bytes, 0), cur(row_bytes);
+    auto load_row = [&](int r, std::uint8_t* dst) {
+        const std::uint8_t* src = data.data() + (vflip ? height - 1 - r : r) * row_bytes;
+        memcpy(dst, src, row_bytes);
+        if (bytespp == GRAYSCALE) return;
+        for (size_t i = 0; i < row_bytes; i += bytespp) std::swap(dst[i], dst[i + 2]);
+    };
+    // the row above the strip is only needed for the filter
+    if (y0 > 0) load_row(y0 - 1, prev.data());
+    for (int r = y0; r < y1; r++) {
+        load_row(r, cur.data());
+        std::uint8_t* dst = filtered.data() + (r - y0) * (row_bytes + 1);
+        dst[0] = 2; // Up
+        for (size_t i = 0; i < row_bytes; i++) dst[1 + i] = (std::uint8_t)(cur[i] - prev[i]);
+        std::swap(prev, cur);
+    }
+    adler = adler32(filtered.data(), filtered.size());
+    deflate_fixed(filtered.data(), filtered.size(), out);
+}
+
+bool TGAImage::write_png_file(const std::string filename, const bool vflip) const {
+    const std::uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    const int strips = strip_count(height, 128);
+    std::vector<std::vector<std::uint8_t>> parts(strips);
+    std::vector<std::uint32_t> adlers(strips);
+    encode_strips(strips, height, [&](int i, int y0, int y1) { encode_png_rows(y0, y1, vflip, parts[i], adlers[i]); });
+
+    size_t nbytes = 0;
+    for (auto& part : parts) nbytes += part.size();
+    std::vector<std::uint8_t> out;
+    out.reserve(sizeof(signature) + 25 + 12 + 2 + nbytes + 6 + 12);
+    append(out, signature, sizeof(signature));
+
+    // type and data of a chunk are appended by fill, the length and crc around them here
+    auto chunk = [&](const char* type, const std::function<void()>& fill) {
+        size_t start = out.size();
+        append_be32(out, 0);
+        append(out, type, 4);
+        fill();
+        std::uint32_t length = (std::uint32_t)(out.size() - start - 8);
+        for (int i = 0; i < 4; i++) out[start + i] = (std::uint8_t)(length >> (24 - 8 * i));
+        append_be32(out, crc32(out.data() + start + 4, length + 4));
+    };
+    chunk("IHDR", [&] {
+        append_be32(out, width);
+        append_be32(out, height);
+        const std::uint8_t color_type = bytespp == GRAYSCALE ? 0 : bytespp == RGB ? 2 : 6;
+        const std::uint8_t rest[5] = { 8, color_type, 0, 0, 0 }; // bit depth, color type, deflate, adaptive filter, no interlace
+        append(out, rest, 5);
+    });
+    chunk("IDAT", [&] {
+        const std::uint8_t zlib_header[2] = { 0x78, 0x01 };
+        const std::uint8_t final_block[2] = { 0x03, 0x00 }; // final, fixed huffman, end of block
+        append(out, zlib_header, 2);
+        std::uint32_t adler = 1;
+        const size_t row_bytes = (size_t)width * bytespp + 1;
+        for (int i = 0; i < strips; i++) {
+            append(out, parts[i].data(), parts[i].size());
+            adler = adler32_combine(adler, adlers[i], row_bytes * (strip_begin(i + 1, strips, height) - strip_begin(i, strips, height)));
+        }
+        append(out, final_block, 2);
+        append_be32(out, adler);
+    });
+    chunk("IEND", [] {});
+    return write_file(filename, out);
+}
+
+#pragma endregion
+
 Color32 TGAImage::get(const int x, const int y) const {
     if (!data.size() || x < 0 || y < 0 || x >= width || y >= height)
         return {};
@@ -222,7 +507,7 @@ void TGAImage::set(int x, int y, const Color32& c) {
     memcpy(data.data() + (x + y * width) * bytespp, c.bgra, bytespp);
 }
 
-int TGAImage::get_bytespp() {
+int TGAImage::get_bytespp() const {
     return bytespp;
 }
 
@@ -265,6 +550,10 @@ std::uint8_t* TGAImage::buffer() {
     return data.data();
 }
 
+const std::uint8_t* TGAImage::buffer() const {
+    return data.data();
+}
+
 void TGAImage::clear() {
     data = std::vector<std::uint8_t>(width * height * bytespp, 0);
 }
@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include <fstream>
+#include <string>
 #include <vector>
 #include <algorithm>
 using namespace std;
@@ -70,13 +71,20 @@ protected:
     int bytespp;
 
     bool   load_rle_data(std::ifstream& in);
-    bool unload_rle_data(std::ofstream& out) const;
+    void encode_rle_rows(const int y0, const int y1, std::vector<std::uint8_t>& out) const;
+    void encode_png_rows(const int y0, const int y1, const bool vflip, std::vector<std::uint8_t>& out, std::uint32_t& adler) const;
 public:
 
     TGAImage();
     TGAImage(const int w, const int h, const Format format);
     bool  read_tga_file(const std::string filename);
+    // Every writer encodes the whole file in memory and writes it at once; large images are encoded in
+    // row strips on all cores. vflip means row 0 is the bottom of the picture, as the renderer draws it:
+    // the tga header records that, the top-down formats below take the rows in reverse while encoding.
     bool write_tga_file(const std::string filename, const bool vflip = true, const bool rle = true) const;
+    bool write_ppm_file(const std::string filename, const bool vflip = true) const; // binary P6, P5 for grayscale; alpha is dropped
+    bool write_raw_file(const std::string filename, const bool vflip = true) const; // the pixel bytes (b g r a) top-down, no header
+    bool write_png_file(const std::string filename, const bool vflip = true) const; // 8 bit, fixed huffman deflate
     void flip_horizontally();
     void flip_vertically();
     void scale(const int w, const int h);
@@ -84,8 +92,9 @@ public:
     void set(const int x, const int y, const Color32& c);
     int get_width() const;
     int get_height() const;
-    int get_bytespp();
+    int get_bytespp() const;
     std::uint8_t* buffer();
+    const std::uint8_t* buffer() const;
     void clear();
 };
 